@@ -0,0 +1,180 @@
+// Navigating with grid and place cells in cluttered environments
+// Edvardsen et al. (2020). Hippocampus, 30(3), 220-232.
+//
+// Licensed under the EUPL-1.2-or-later.
+// Copyright (c) 2019 NTNU - Norwegian University of Science and Technology.
+// Author: Vegard Edvardsen (https://github.com/evegard).
+
+#include "cache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The file starts with a header of a magic number, the version and the size
+// of real, followed by the entries. Each entry is the number of key values,
+// the key values (double), the number of integers, the integers (int32_t),
+// the number of reals and the reals, where all counts are uint32_t
+static const char settle_cache_magic[8] = { 'R', 'N', 'S', 'E', 'T', 'T', 'L', 'E' };
+
+struct SettleCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t real_size;
+};
+
+class SettleCacheReader
+{
+    public:
+        SettleCacheReader(const char *data, size_t size)
+            : data(data), size(size), position(0) {}
+
+        // Skips over an array, pointing values at its first byte. The file
+        // is packed, so the values may be unaligned and are only to be
+        // compared or copied as bytes
+        template<typename T>
+        bool read_array(const char *&values, uint32_t &count)
+        {
+            if (!this->read(count) || (this->size - this->position) / sizeof(T) < count) {
+                return false;
+            }
+            values = &this->data[this->position];
+            this->position += count * sizeof(T);
+            return true;
+        }
+
+        template<typename T>
+        bool read(T &value)
+        {
+            if (this->size - this->position < sizeof(T)) {
+                return false;
+            }
+            memcpy(&value, &this->data[this->position], sizeof(T));
+            this->position += sizeof(T);
+            return true;
+        }
+
+        const char *data;
+        size_t size;
+        size_t position;
+};
+
+// The entries of a cache file, mapped for as long as the object lives. There
+// are no entries if the file does not exist or was written by another version
+class SettleCacheMapping
+{
+    public:
+        SettleCacheMapping(const std::string &path)
+            : mapping(MAP_FAILED), mapping_size(0), entries(nullptr), entries_size(0)
+        {
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                return;
+            }
+            struct stat file_stat;
+            if (fstat(fd, &file_stat) == 0 &&
+                    (size_t)file_stat.st_size >= sizeof(SettleCacheHeader)) {
+                this->mapping_size = file_stat.st_size;
+                this->mapping = mmap(nullptr, this->mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            }
+            close(fd);
+            if (this->mapping == MAP_FAILED) {
+                return;
+            }
+            const char *data = (const char *)this->mapping;
+            SettleCacheHeader header;
+            memcpy(&header, data, sizeof(header));
+            if (memcmp(header.magic, settle_cache_magic, sizeof(settle_cache_magic)) == 0 &&
+                    header.version == SETTLE_CACHE_VERSION &&
+                    header.real_size == sizeof(real)) {
+                this->entries = data + sizeof(header);
+                this->entries_size = this->mapping_size - sizeof(header);
+            }
+        }
+
+        ~SettleCacheMapping()
+        {
+            if (this->mapping != MAP_FAILED) {
+                munmap(this->mapping, this->mapping_size);
+            }
+        }
+
+        void *mapping;
+        size_t mapping_size;
+        const char *entries;
+        size_t entries_size;
+};
+
+template<typename T>
+static bool write_array(FILE *file, const T *values, uint32_t count)
+{
+    return fwrite(&count, sizeof(count), 1, file) == 1 &&
+        fwrite(values, sizeof(T), count, file) == count;
+}
+
+SettleCache::SettleCache(std::string path)
+    : path(path)
+{
+}
+
+bool SettleCache::load(const std::vector<double> &key,
+        std::vector<int32_t> &integers, std::vector<real> &reals)
+{
+    // The entries are searched where they are mapped, and only the values
+    // of the matching entry are copied out
+    SettleCacheMapping mapping(this->path);
+    SettleCacheReader reader(mapping.entries, mapping.entries_size);
+    while (reader.position < reader.size) {
+        const char *entry_key, *entry_integers, *entry_reals;
+        uint32_t key_count, integer_count, real_count;
+        if (!reader.read_array<double>(entry_key, key_count) ||
+                !reader.read_array<int32_t>(entry_integers, integer_count) ||
+                !reader.read_array<real>(entry_reals, real_count)) {
+            // Truncated file, ignore the rest of it
+            return false;
+        }
+        if (key_count == key.size() &&
+                memcmp(entry_key, key.data(), key_count * sizeof(double)) == 0) {
+            integers.resize(integer_count);
+            memcpy(integers.data(), entry_integers, integer_count * sizeof(int32_t));
+            reals.resize(real_count);
+            memcpy(reals.data(), entry_reals, real_count * sizeof(real));
+            return true;
+        }
+    }
+    return false;
+}
+
+void SettleCache::save(const std::vector<double> &key,
+        const std::vector<int32_t> &integers, const std::vector<real> &reals)
+{
+    SettleCacheHeader header;
+    memcpy(header.magic, settle_cache_magic, sizeof(settle_cache_magic));
+    header.version = SETTLE_CACHE_VERSION;
+    header.real_size = sizeof(real);
+
+    // Write to a temporary file first, so that concurrent runs never see a
+    // partially written cache. The existing entries are written straight
+    // from the mapping of the old file, followed by the new entry
+    std::string temporary_path = this->path + ".tmp." + std::to_string(getpid());
+    FILE *file = fopen(temporary_path.c_str(), "wb");
+    if (file == nullptr) {
+        return;
+    }
+    bool written = (fwrite(&header, sizeof(header), 1, file) == 1);
+    {
+        SettleCacheMapping mapping(this->path);
+        written &= (fwrite(mapping.entries, 1, mapping.entries_size, file) ==
+            mapping.entries_size);
+    }
+    written &= write_array(file, key.data(), key.size());
+    written &= write_array(file, integers.data(), integers.size());
+    written &= write_array(file, reals.data(), reals.size());
+    written &= (fclose(file) == 0);
+    if (!written || rename(temporary_path.c_str(), this->path.c_str()) != 0) {
+        unlink(temporary_path.c_str());
+    }
+}
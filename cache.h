@@ -0,0 +1,39 @@
+// Navigating with grid and place cells in cluttered environments
+// Edvardsen et al. (2020). Hippocampus, 30(3), 220-232.
+//
+// Licensed under the EUPL-1.2-or-later.
+// Copyright (c) 2019 NTNU - Norwegian University of Science and Technology.
+// Author: Vegard Edvardsen (https://github.com/evegard).
+
+#ifndef CACHE_H_INCLUDED
+#define CACHE_H_INCLUDED
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "numerical.h"
+
+// Bump whenever the layout of the file or the meaning of its contents
+// changes, which invalidates all existing cache files
+#define SETTLE_CACHE_VERSION 1
+
+// File of settled model states, each stored under a key of all the
+// parameters that the state depends on. The file is memory-mapped when
+// searched, and rewritten (through a temporary file) when a state is added.
+// Entries with other keys are kept, so that runs with different parameters
+// can share one file
+class SettleCache
+{
+    public:
+        SettleCache(std::string path);
+        bool load(const std::vector<double> &key,
+            std::vector<int32_t> &integers, std::vector<real> &reals);
+        void save(const std::vector<double> &key,
+            const std::vector<int32_t> &integers, const std::vector<real> &reals);
+
+    protected:
+        std::string path;
+};
+
+#endif
@@ -20,10 +20,10 @@ PlaceCell::PlaceCell(int index, double x, double y)
 void PlaceCell::capture_grid_state_from_model(Model *model)
 {
     for (int i = 0; i < model->conf.module_count; i++) {
-        Vector *grid_module_copy = new Vector(
-            model->mec_moving_convolved[i]->neurons[current_activity]->size);
-        grid_module_copy->copy_from(
-            model->mec_moving_convolved[i]->neurons[current_activity]);
+        Vector *activity = model->mec_moving_convolved[i]->neurons[current_activity];
+        CompactVector *grid_module_copy = new CompactVector(
+            activity->size, model->conf.storage_precision);
+        grid_module_copy->store(activity->values);
         this->grid_state.push_back(grid_module_copy);
     }
 }
@@ -32,8 +32,9 @@ void PlaceCell::transfer_grid_state_to_decoder(Model *model)
 {
     assert(this->grid_state.size() == model->conf.module_count);
     for (int i = 0; i < model->conf.module_count; i++) {
-        model->mec_fixed_convolved[i]->neurons[current_activity]->copy_from(
-            this->grid_state[i]);
+        this->grid_state[i]->load(
+            model->mec_fixed_convolved[i]->neurons[current_activity]->values);
+        model->mec_fixed_convolved[i]->activity_changed();
     }
 }
 
@@ -62,20 +63,37 @@ double PlaceCell::direction(double x, double y)
 
 PlaceGraph::PlaceGraph(double place_cell_radius) : place_cell_radius(place_cell_radius) {}
 
-void PlaceGraph::update(Model *model)
+void PlaceGraph::locate(double x, double y)
 {
-    // First, "visit" the current location -- retrieve the place cell closest to
-    // the current location, and if that cell is too far away, create a new one
-
     PlaceCell *closest_cell = nullptr;
     double closest_dist = HUGE_VAL;
     for (PlaceCell *current_cell : this->cells) {
-        double current_dist = current_cell->distance(this->input.x, this->input.y);
+        double current_dist = current_cell->distance(x, y);
         if (closest_cell == nullptr || current_dist < closest_dist) {
             closest_cell = current_cell;
             closest_dist = current_dist;
         }
     }
+    this->located = true;
+    this->located_x = x;
+    this->located_y = y;
+    this->located_cell_count = this->cells.size();
+    this->located_cell = closest_cell;
+    this->located_distance = closest_dist;
+}
+
+void PlaceGraph::update(Model *model)
+{
+    // First, "visit" the current location -- retrieve the place cell closest to
+    // the current location, and if that cell is too far away, create a new one
+
+    if (!this->located || this->located_x != this->input.x || this->located_y != this->input.y ||
+            this->located_cell_count != this->cells.size()) {
+        this->locate(this->input.x, this->input.y);
+    }
+    this->located = false;
+    PlaceCell *closest_cell = this->located_cell;
+    double closest_dist = this->located_distance;
     if (this->input.form_place_cells && (
                 closest_cell == nullptr ||
                 closest_dist > 2 * this->place_cell_radius)) {
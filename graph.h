@@ -35,7 +35,7 @@ class PlaceCell
         std::vector<std::pair<PlaceCell *, int>> neighbors;
         PlaceCell *bfs_predecessor = nullptr;
         PlaceCell *replay_source = nullptr;
-        std::vector<Vector *> grid_state;
+        std::vector<CompactVector *> grid_state;
 };
 
 class PlaceGraph
@@ -43,6 +43,10 @@ class PlaceGraph
     public:
         PlaceGraph(double place_cell_radius);
         void update(Model *model);
+        // Finds the place cell closest to (x, y), which is the first part of
+        // update(). If called ahead of update() with the coordinates of its
+        // input, update() takes the cell found here
+        void locate(double x, double y);
 
         // Input variables
 
@@ -77,6 +81,13 @@ class PlaceGraph
         PlaceCell *replay_cell = nullptr;
         double place_cell_radius;
 
+        // The result of the last call to locate()
+        bool located = false;
+        double located_x, located_y;
+        std::size_t located_cell_count;
+        PlaceCell *located_cell;
+        double located_distance;
+
         void plot_place_cells(std::ostream &stream);
 };
 
@@ -15,6 +15,7 @@
 #include "simulation.h"
 #include "plot.h"
 #include "mec.h"
+#include "simd.h"
 #include "main.h"
 
 int usage(char *argv0)
@@ -37,7 +38,46 @@ int usage(char *argv0)
     std::cerr << "  --live-plot\t\tSend plots to the ./plot_pipe FIFO at regular intervals." << std::endl;
     std::cerr << "  --final-plot\t\tDump the final plot on stdout upon termination." << std::endl;
     std::cerr << "  --lite-plot\t\tLite version of the plot." << std::endl;
+    std::cerr << "  --task-graph=F\tWrite the tasks run on each timestep and their dependencies to file F (Graphviz)." << std::endl;
     std::cerr << "  --field-size=N\tUse N as the place field radius." << std::endl;
+    std::cerr << "  --gain-mode=G\t\tUse G to scale the velocity input of each grid module. Valid options:" << std::endl;
+    std::cerr << "           \t\t  poisson (default, gate the neurons randomly)" << std::endl;
+    std::cerr << "           \t\t  velocity (scale the velocity input)" << std::endl;
+    std::cerr << "           \t\t  kinematic (shift a settled template, fast)" << std::endl;
+    std::cerr << "  --correlation=E\tUse E to evaluate the grid sheet connectivity. Valid options:" << std::endl;
+    std::cerr << "           \t\t  auto (default, dense or fft for each input)" << std::endl;
+    std::cerr << "           \t\t  dense" << std::endl;
+    std::cerr << "           \t\t  fft" << std::endl;
+    std::cerr << "           \t\t  separable" << std::endl;
+    std::cerr << "           \t\t  sparse" << std::endl;
+    std::cerr << "           \t\t  delta (approximate)" << std::endl;
+    std::cerr << "  --simd=S\t\tUse instruction set S for the sheet kernels. Valid options:" << std::endl;
+    std::cerr << "           \t\t  auto (default, best supported)" << std::endl;
+    std::cerr << "           \t\t  scalar" << std::endl;
+    std::cerr << "           \t\t  avx2" << std::endl;
+    std::cerr << "           \t\t  avx512" << std::endl;
+    std::cerr << "  --sheet-size=N\tUse N x N neurons per grid cell sheet (default " STRINGIFY_CONSTANT(MEC_SIZE) ")." << std::endl;
+    std::cerr << "  --sparse-threshold=T\tOnly scatter afferent activity above T in the sparse engine (default 0.0001)." << std::endl;
+    std::cerr << "  --delta-threshold=T\tOnly propagate afferent changes above T in the delta engine (default 0.001)." << std::endl;
+    std::cerr << "  --delta-refresh=K\tRecompute the delta engine exactly every K steps (default 50)." << std::endl;
+    std::cerr << "  --seed=N\t\tSeed the random number generators with N (default random)." << std::endl;
+    std::cerr << "  --settle-tolerance=T\tStop settling a grid module once no neuron changes by more than T (default 1e-4, 0 to always settle for " STRINGIFY_CONSTANT(SETTLE_STEPS) " steps)." << std::endl;
+    std::cerr << "  --threads=N\t\tSettle and step the grid modules on N threads (default 1)." << std::endl;
+    std::cerr << "  --pin-threads\t\tPin each of the worker threads to its own core." << std::endl;
+    std::cerr << "  --settle-cache=F\tLoad the settled grid modules from cache file F, or settle and add them to it (only hits with --seed)." << std::endl;
+    std::cerr << "  --quiescence-tolerance=T\tStop updating the grid modules of a halted agent once no neuron changes by more than T (default 0, which disables it)." << std::endl;
+    std::cerr << "  --decoder=D\t\tUse D to find the direction towards a goal from the grid modules. Valid options:" << std::endl;
+    std::cerr << "           \t\t  neural (default, MEC diff and motor networks)" << std::endl;
+    std::cerr << "           \t\t  analytic (displacements between the tracked bumps, fast)" << std::endl;
+    std::cerr << "           \t\t  validate (neural, reporting how far off analytic would be)" << std::endl;
+    std::cerr << "  --mec-diff-layout=L\tStore the grid decoder neurons in layout L. Valid options:" << std::endl;
+    std::cerr << "           \t\t  direction-major (default, one padded plane per direction)" << std::endl;
+    std::cerr << "           \t\t  interleaved (directions innermost)" << std::endl;
+    std::cerr << "  --storage-precision=P\tStore the grid states of place cells in precision P. Valid options:" << std::endl;
+    std::cerr << "           \t\t  fp32 (default)" << std::endl;
+    std::cerr << "           \t\t  fp16" << std::endl;
+    std::cerr << "           \t\t  bf16" << std::endl;
+    std::cerr << "           \t\t  int8" << std::endl;
     return 1;
 }
 
@@ -46,39 +86,79 @@ int main(int argc, char **argv)
     int getopt_simconf_live_plot = 0;
     int getopt_simconf_final_plot = 0;
     int getopt_simconf_lite_plot = 0;
+    int getopt_modconf_pin_threads = 0;
     std::string getopt_agent_type;
+    std::string getopt_correlation_engine = "auto";
+    std::string getopt_simd_instruction_set = "auto";
+    std::string getopt_storage_precision = "fp32";
+    std::string getopt_gain_mode = "poisson";
+    std::string getopt_mec_diff_layout = "direction-major";
+    std::string getopt_decoder = "neural";
 
     struct SimulationConf simconf = {
         .live_plot = false, // Will be overwritten to (bool)getopt_simconf_live_plot
         .final_plot = false, // Will be overwritten to (bool)getopt_simconf_final_plot
         .lite_plot = false, // Will be overwritten to (bool)getopt_simconf_lite_plot
         .script_source = "",
+        .task_graph_dump = "",
     };
     struct ModelConf modconf = {
         .module_count = 0,
+        .sheet_size = MEC_SIZE,
         .gain_mode = gain_mode_poisson_neuron,
         .gain_ratio = 1.5,
         .initial_gain = MAX_MEC_GAIN,
         .alternative_motor_scaling = false,
         .simplified_mec_diff = false,
-        .direction_samples = 28,
-        .xy_samples = 9,
+        .mec_diff_layout = mec_diff_layout_direction_major,
+        .decoder = decoder_neural,
+        .direction_samples = DEFAULT_DIRECTION_SAMPLES,
+        .xy_samples = DEFAULT_XY_SAMPLES,
         .mec_diff_offset = 7,
-        .sensor_count = 72,
+        .sensor_count = DEFAULT_SENSOR_COUNT,
         .sensor_range = 25.0,
         .place_cell_radius = 7.0,
         .internal_motor_tuning = 0.1,
+        .quiescence_tolerance = 0.0,
+        .settle_tolerance = 1e-4,
+        .thread_count = 1,
+        .pin_threads = false, // Will be overwritten to (bool)getopt_modconf_pin_threads
+        .correlation = {
+            .engine = correlation_engine_auto,
+            .sparse_threshold = 0.0001,
+            .delta_threshold = 0.001,
+            .delta_refresh_interval = 50,
+        },
+        .storage_precision = storage_precision_fp32,
+        .settle_cache = "",
     };
 
     struct option options[] = {
         { "live-plot", no_argument, &getopt_simconf_live_plot, 1 },
         { "final-plot", no_argument, &getopt_simconf_final_plot, 1 },
         { "lite-plot", no_argument, &getopt_simconf_lite_plot, 1 },
+        { "pin-threads", no_argument, &getopt_modconf_pin_threads, 1 },
 
         { "modules", required_argument, nullptr, 1 },
         { "agent", required_argument, nullptr, 2 },
         { "script", required_argument, nullptr, 3 },
         { "field-size", required_argument, nullptr, 4 },
+        { "correlation", required_argument, nullptr, 5 },
+        { "sparse-threshold", required_argument, nullptr, 6 },
+        { "simd", required_argument, nullptr, 7 },
+        { "sheet-size", required_argument, nullptr, 8 },
+        { "storage-precision", required_argument, nullptr, 9 },
+        { "seed", required_argument, nullptr, 10 },
+        { "delta-threshold", required_argument, nullptr, 11 },
+        { "delta-refresh", required_argument, nullptr, 12 },
+        { "gain-mode", required_argument, nullptr, 13 },
+        { "quiescence-tolerance", required_argument, nullptr, 14 },
+        { "settle-cache", required_argument, nullptr, 15 },
+        { "settle-tolerance", required_argument, nullptr, 16 },
+        { "threads", required_argument, nullptr, 17 },
+        { "mec-diff-layout", required_argument, nullptr, 18 },
+        { "decoder", required_argument, nullptr, 19 },
+        { "task-graph", required_argument, nullptr, 20 },
 
         { 0, 0, 0, 0 }
     };
@@ -90,18 +170,123 @@ int main(int argc, char **argv)
         case 2: getopt_agent_type = optarg; break;
         case 3: simconf.script_source = optarg; break;
         case 4: modconf.place_cell_radius = std::stod(optarg); break;
+        case 5: getopt_correlation_engine = optarg; break;
+        case 6: modconf.correlation.sparse_threshold = std::stod(optarg); break;
+        case 7: getopt_simd_instruction_set = optarg; break;
+        case 8: modconf.sheet_size = std::stoi(optarg); break;
+        case 9: getopt_storage_precision = optarg; break;
+        case 10: Random::seed(std::stoul(optarg)); break;
+        case 11: modconf.correlation.delta_threshold = std::stod(optarg); break;
+        case 12: modconf.correlation.delta_refresh_interval = std::stoi(optarg); break;
+        case 13: getopt_gain_mode = optarg; break;
+        case 14: modconf.quiescence_tolerance = std::stod(optarg); break;
+        case 15: modconf.settle_cache = optarg; break;
+        case 16: modconf.settle_tolerance = std::stod(optarg); break;
+        case 17: modconf.thread_count = std::stoi(optarg); break;
+        case 18: getopt_mec_diff_layout = optarg; break;
+        case 19: getopt_decoder = optarg; break;
+        case 20: simconf.task_graph_dump = optarg; break;
         }
     }
 
     simconf.live_plot = (bool)getopt_simconf_live_plot;
     simconf.final_plot = (bool)getopt_simconf_final_plot;
     simconf.lite_plot = (bool)getopt_simconf_lite_plot;
+    modconf.pin_threads = (bool)getopt_modconf_pin_threads;
 
     if (modconf.module_count <= 0) {
         std::cerr << "Error: Module count (--modules=N) must be greater than zero." << std::endl;
         return usage(argv[0]);
     }
 
+    if (modconf.sheet_size < 16 || modconf.sheet_size % 2 != 0) {
+        std::cerr << "Error: Sheet size (--sheet-size=N) must be an even number of at least 16." << std::endl;
+        return usage(argv[0]);
+    }
+
+    if (modconf.thread_count <= 0) {
+        std::cerr << "Error: Thread count (--threads=N) must be greater than zero." << std::endl;
+        return usage(argv[0]);
+    }
+
+    if (getopt_gain_mode == "poisson") {
+        modconf.gain_mode = gain_mode_poisson_neuron;
+    } else if (getopt_gain_mode == "velocity") {
+        modconf.gain_mode = gain_mode_velocity;
+    } else if (getopt_gain_mode == "kinematic") {
+        modconf.gain_mode = gain_mode_kinematic;
+    } else {
+        std::cerr << "Error: Invalid gain mode." << std::endl;
+        return usage(argv[0]);
+    }
+
+    if (getopt_correlation_engine == "dense") {
+        modconf.correlation.engine = correlation_engine_dense;
+    } else if (getopt_correlation_engine == "fft") {
+        modconf.correlation.engine = correlation_engine_fft;
+    } else if (getopt_correlation_engine == "separable") {
+        modconf.correlation.engine = correlation_engine_separable;
+    } else if (getopt_correlation_engine == "sparse") {
+        modconf.correlation.engine = correlation_engine_sparse;
+    } else if (getopt_correlation_engine == "delta") {
+        modconf.correlation.engine = correlation_engine_delta;
+    } else if (getopt_correlation_engine == "auto") {
+        modconf.correlation.engine = correlation_engine_auto;
+    } else {
+        std::cerr << "Error: Invalid correlation engine." << std::endl;
+        return usage(argv[0]);
+    }
+
+    if (modconf.correlation.delta_refresh_interval <= 0) {
+        std::cerr << "Error: Delta refresh interval (--delta-refresh=K) must be greater than zero." << std::endl;
+        return usage(argv[0]);
+    }
+
+    if (getopt_simd_instruction_set != "auto") {
+        bool selected = false;
+        for (int i = 0; i < SIMD_INSTRUCTION_SET_COUNT; i++) {
+            if (getopt_simd_instruction_set == Simd::name((SimdInstructionSet)i)) {
+                selected = Simd::select((SimdInstructionSet)i);
+            }
+        }
+        if (!selected) {
+            std::cerr << "Error: Invalid or unsupported SIMD instruction set." << std::endl;
+            return usage(argv[0]);
+        }
+    }
+
+    if (getopt_decoder == "neural") {
+        modconf.decoder = decoder_neural;
+    } else if (getopt_decoder == "analytic") {
+        modconf.decoder = decoder_analytic;
+    } else if (getopt_decoder == "validate") {
+        modconf.decoder = decoder_validate;
+    } else {
+        std::cerr << "Error: Invalid grid decoder." << std::endl;
+        return usage(argv[0]);
+    }
+
+    if (getopt_mec_diff_layout == "interleaved") {
+        modconf.mec_diff_layout = mec_diff_layout_interleaved;
+    } else if (getopt_mec_diff_layout == "direction-major") {
+        modconf.mec_diff_layout = mec_diff_layout_direction_major;
+    } else {
+        std::cerr << "Error: Invalid MEC diff layout." << std::endl;
+        return usage(argv[0]);
+    }
+
+    bool storage_precision_found = false;
+    for (int i = 0; i < STORAGE_PRECISION_COUNT; i++) {
+        if (getopt_storage_precision == CompactVector::name((StoragePrecision)i)) {
+            modconf.storage_precision = (StoragePrecision)i;
+            storage_precision_found = true;
+        }
+    }
+    if (!storage_precision_found) {
+        std::cerr << "Error: Invalid storage precision." << std::endl;
+        return usage(argv[0]);
+    }
+
     Model *model = new Model(modconf);
     Agent *agent;
 
@@ -127,10 +312,28 @@ int main(int argc, char **argv)
     }
 
     std::cerr << "Module count: " << modconf.module_count << std::endl;
+    std::cerr << "Sheet size: " << modconf.sheet_size << std::endl;
     std::cerr << "Agent type: " << getopt_agent_type << std::endl;
     std::cerr << "Place field radius: " << modconf.place_cell_radius << std::endl;
+    std::cerr << "Gain mode: " << getopt_gain_mode << std::endl;
+    std::cerr << "Grid decoder: " << getopt_decoder << std::endl;
+    std::cerr << "SIMD instruction set: " << Simd::name(Simd::instruction_set) << std::endl;
+    std::cerr << "Storage precision: " << CompactVector::name(modconf.storage_precision) << std::endl;
+    std::cerr << "Random seed: " << Random::get_seed() << std::endl;
+    std::cerr << "Threads: " << modconf.thread_count
+        << (modconf.pin_threads ? " (pinned)" : "") << std::endl;
+    if (!modconf.settle_cache.empty()) {
+        std::cerr << "Settle cache: " << modconf.settle_cache << std::endl;
+    }
 
     Simulation *simulation = new Simulation(agent, simconf);
     model->settle();
-    return simulation->run();
+    int result = simulation->run();
+    if (modconf.correlation.engine == correlation_engine_delta) {
+        MecShiftedMaskInput::report_delta_error(std::cerr);
+    }
+    if (modconf.decoder == decoder_validate) {
+        model->report_decoder_error(std::cerr);
+    }
+    return result;
 }
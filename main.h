@@ -16,24 +16,71 @@
 enum MecGainMode {
     gain_mode_velocity,
     gain_mode_poisson_neuron,
+    gain_mode_kinematic,
 
     GAIN_MODE_COUNT
 };
 
+enum MecCorrelationEngine {
+    correlation_engine_dense,
+    correlation_engine_fft,
+    correlation_engine_separable,
+    correlation_engine_sparse,
+    correlation_engine_delta,
+    correlation_engine_auto,
+
+    CORRELATION_ENGINE_COUNT
+};
+
+struct MecCorrelationConf {
+    MecCorrelationEngine engine;
+    double sparse_threshold;
+    double delta_threshold;
+    int delta_refresh_interval;
+};
+
+enum DecoderMode {
+    decoder_neural,
+    decoder_analytic,
+    decoder_validate,
+
+    DECODER_MODE_COUNT
+};
+
+enum MecDiffLayout {
+    mec_diff_layout_interleaved,
+    mec_diff_layout_direction_major,
+
+    MEC_DIFF_LAYOUT_COUNT
+};
+
+enum StoragePrecision {
+    storage_precision_fp32,
+    storage_precision_fp16,
+    storage_precision_bf16,
+    storage_precision_int8,
+
+    STORAGE_PRECISION_COUNT
+};
+
 struct SimulationConf {
     bool live_plot;
     bool final_plot;
     bool lite_plot;
     std::string script_source;
+    std::string task_graph_dump;
 };
 
 struct ModelConf {
     int module_count;
+    int sheet_size;
     MecGainMode gain_mode;
     double gain_ratio;
     double initial_gain;
     bool alternative_motor_scaling;
     bool simplified_mec_diff;
+    MecDiffLayout mec_diff_layout;
+    DecoderMode decoder;
     int direction_samples;
     int xy_samples;
     int mec_diff_offset;
@@ -41,10 +88,19 @@ struct ModelConf {
     double sensor_range;
     double place_cell_radius;
     double internal_motor_tuning;
+    double quiescence_tolerance;
+    double settle_tolerance;
+    int thread_count;
+    bool pin_threads;
+    struct MecCorrelationConf correlation;
+    StoragePrecision storage_precision;
+    std::string settle_cache;
 };
 
 // mec.h
 
+// Default side length of the grid cell sheets, see --sheet-size. The sheet
+// kernels are specialized at compile time for the sizes 32, 40, 48 and 64
 #define MEC_SIZE 40
 
 #define MAX_MEC_SPEED 120.0
@@ -53,10 +109,26 @@ struct ModelConf {
 
 #define BUMP_TRACKER_RADIUS 5
 
+// The automatic correlation engine uses the FFT engine for inputs that need
+// the sums for more than this fraction of all shifts in every step, as it
+// calculates all of them for about the cost of that many dense dot products
+#define AUTO_FFT_SHIFT_FRACTION 0.125
+
+// Width of the halo around the padded copies of the sheets, which must cover
+// the reach of every stencil that reads them (the bump tracker being widest)
+#define SHEET_HALO BUMP_TRACKER_RADIUS
+
 // numerical.h
 
-#define REAL_ALIGNMENT 32
-#define REAL_STRIDE 8
+#define REAL_ALIGNMENT 64
+#define REAL_STRIDE 16
+
+// parallel.h
+
+// Number of pause instructions that the threads of a pool spin for while
+// waiting, before they go to sleep. A timestep takes well under a millisecond,
+// so this covers the wait between the batches of consecutive timesteps
+#define THREAD_POOL_SPIN_ITERATIONS 4096
 
 // simulation.h
 
@@ -67,6 +139,14 @@ struct ModelConf {
 
 // motor.h
 
+// Directions of the grid decoder, (x, y) samples per axis of the MEC diff
+// networks and border sensors of the paper configuration. The loops over the
+// directions of the motor and MEC diff networks are specialized at compile
+// time for these counts
+#define DEFAULT_DIRECTION_SAMPLES 28
+#define DEFAULT_XY_SAMPLES 9
+#define DEFAULT_SENSOR_COUNT 72
+
 #define GRID_MOTOR_PLOT_RANGE 4.0
 #define ALL_MOTORS_PLOT_RANGE 8.0
 #define UI_MOTOR_PLOT_RANGE 2.0
@@ -76,7 +156,19 @@ struct ModelConf {
 
 // model.h
 
+// Each module settles for at most SETTLE_STEPS steps. After the bump has
+// formed, which takes about SETTLE_MIN_STEPS steps from the initial noise, a
+// module stops once neither its neurons (by the settle tolerance) nor its bump
+// (by SETTLE_BUMP_TOLERANCE neurons) have moved for SETTLE_STABLE_STEPS steps
 #define SETTLE_STEPS 1000
+#define SETTLE_MIN_STEPS 200
+#define SETTLE_STABLE_STEPS 50
+#define SETTLE_BUMP_TOLERANCE 0.01
+
+// Steps of the attractor dynamics used to measure the bump velocity of each
+// module for the kinematic gain mode, per axis, after a few warm-up steps
+#define KINEMATIC_WARMUP_STEPS 20
+#define KINEMATIC_CALIBRATION_STEPS 400
 
 // graph.h
 
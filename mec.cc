@@ -9,23 +9,70 @@
 
 #include <cmath>
 #include <cstdlib>
+#include <iostream>
 
-NeuralSheetNetwork::NeuralSheetNetwork(real gain)
-    : Network(MEC_SIZE * MEC_SIZE),
+#include "simd.h"
+
+NeuralSheetNetwork::NeuralSheetNetwork(int sheet_size, real gain)
+    : Network(sheet_size * sheet_size), sheet_size(sheet_size),
       bump_tracker_initialized(false)
 {
     this->gain = gain;
-    this->lambda = MEC_SIZE * 15.0 / 40.0; // "Periodicity"
+    this->lambda = sheet_size * 15.0 / 40.0; // "Periodicity"
     this->beta = 3.0 / (this->lambda * this->lambda);
     this->gamma = 1.05 * this->beta;
+
+    for (int dy = -BUMP_TRACKER_RADIUS; dy < BUMP_TRACKER_RADIUS + 1; dy++) {
+        int half_width = 0;
+        while ((half_width + 1) * (half_width + 1) + dy * dy <=
+                BUMP_TRACKER_RADIUS * BUMP_TRACKER_RADIUS) {
+            half_width++;
+        }
+        this->disc_half_widths.push_back(half_width);
+    }
+    this->row_mass_sums.resize(sheet_size * (sheet_size + 2 * SHEET_HALO + 1));
+    this->row_moment_sums.resize(sheet_size * (sheet_size + 2 * SHEET_HALO + 1));
+    this->row_stamps.resize(sheet_size, -1);
+    this->tracker_stamp = 0;
+
+    this->padded_activity = new PaddedSheet(sheet_size, sheet_size, SHEET_HALO);
+    this->padded_activity_stale = true;
+}
+
+void NeuralSheetNetwork::activity_changed()
+{
+    Network::activity_changed();
+    this->padded_activity_stale = true;
+}
+
+real NeuralSheetNetwork::get_max_change()
+{
+    // The largest difference of any neuron between the current and the next
+    // activity, i.e. the pending update, or the last one after a commit
+    const real *current = this->neurons[current_activity]->values;
+    const real *next = this->neurons[next_activity]->values;
+    real max_change = 0.0;
+    for (int i = 0; i < this->size; i++) {
+        max_change = MAX(max_change, std::abs(next[i] - current[i]));
+    }
+    return max_change;
+}
+
+PaddedSheet *NeuralSheetNetwork::get_padded_activity()
+{
+    if (this->padded_activity_stale) {
+        this->padded_activity->refresh(this->neurons[current_activity]->values);
+        this->padded_activity_stale = false;
+    }
+    return this->padded_activity;
 }
 
 void NeuralSheetNetwork::initialize_bump_tracker()
 {
     // Initialize the bump tracker to the maximally activated neuron
     real max_activation = -1;
-    for (int y = 0; y < MEC_SIZE; y++) {
-        for (int x = 0; x < MEC_SIZE; x++) {
+    for (int y = 0; y < this->sheet_size; y++) {
+        for (int x = 0; x < this->sheet_size; x++) {
             int neuron_index = this->coords_to_neuron_index(x, y);
             real activation = this->neurons[current_activity]->values[neuron_index];
             if (activation > max_activation) {
@@ -52,6 +99,8 @@ void NeuralSheetNetwork::update_bump_tracker()
     if (!this->bump_tracker_initialized) {
         return;
     }
+    // Invalidate the prefix sums from the previous update
+    this->tracker_stamp++;
     while (true) {
         // Calculate the mass under the disc centered at the current bump
         // location, as well as the displacement to the center of mass
@@ -61,8 +110,8 @@ void NeuralSheetNetwork::update_bump_tracker()
             this->calculate_disc_mass(this->bump_x, this->bump_y);
         // Calculate the (wrapped) coordinates for the center of mass, as our
         // candidate for the new bump location
-        int center_of_mass_x = Periodic::modulo(this->bump_x + center_of_mass_dx, MEC_SIZE);
-        int center_of_mass_y = Periodic::modulo(this->bump_y + center_of_mass_dy, MEC_SIZE);
+        int center_of_mass_x = Periodic::modulo(this->bump_x + center_of_mass_dx, this->sheet_size);
+        int center_of_mass_y = Periodic::modulo(this->bump_y + center_of_mass_dy, this->sheet_size);
         // Calculate the mass at the new potential bump location
         real new_mass;
         std::tie(new_mass, std::ignore, std::ignore) =
@@ -82,43 +131,219 @@ void NeuralSheetNetwork::update_bump_tracker()
 
 std::tuple<real, int, int> NeuralSheetNetwork::calculate_disc_mass(int center_x, int center_y)
 {
-    real mass = 0.0, weighted_dx = 0.0, weighted_dy = 0;
+    double mass, weighted_dx, weighted_dy;
+    this->calculate_disc_moments(center_x, center_y, mass, weighted_dx, weighted_dy);
+    int center_of_mass_dx = round(weighted_dx / mass);
+    int center_of_mass_dy = round(weighted_dy / mass);
+    return std::make_tuple(mass, center_of_mass_dx, center_of_mass_dy);
+}
+
+void NeuralSheetNetwork::calculate_disc_moments(int center_x, int center_y,
+        double &mass, double &weighted_dx, double &weighted_dy)
+{
+    int row_length = this->sheet_size + 2 * SHEET_HALO + 1;
+    mass = 0.0;
+    weighted_dx = 0.0;
+    weighted_dy = 0.0;
     for (int dy = -BUMP_TRACKER_RADIUS; dy < BUMP_TRACKER_RADIUS + 1; dy++) {
-        for (int dx = -BUMP_TRACKER_RADIUS; dx < BUMP_TRACKER_RADIUS + 1; dx++) {
-            if (dx * dx + dy * dy > BUMP_TRACKER_RADIUS * BUMP_TRACKER_RADIUS) {
+        int y = center_y + dy;
+        if (y < 0) {
+            y += this->sheet_size;
+        } else if (y >= this->sheet_size) {
+            y -= this->sheet_size;
+        }
+        this->prepare_row(y);
+        // The row of the disc covers x = center_x - half_width, ...,
+        // center_x + half_width, which lies within the halo on both sides
+        int half_width = this->disc_half_widths[dy + BUMP_TRACKER_RADIUS];
+        int start = SHEET_HALO + center_x - half_width;
+        int end = SHEET_HALO + center_x + half_width + 1;
+        double *mass_sums = &this->row_mass_sums[y * row_length];
+        double *moment_sums = &this->row_moment_sums[y * row_length];
+        double row_mass = mass_sums[end] - mass_sums[start];
+        double row_moment = moment_sums[end] - moment_sums[start];
+        mass += row_mass;
+        weighted_dx += row_moment - center_x * row_mass;
+        weighted_dy += dy * row_mass;
+    }
+}
+
+std::pair<double, double> NeuralSheetNetwork::get_bump_displacement()
+{
+    this->tracker_stamp++;
+    double mass, weighted_dx, weighted_dy;
+    this->calculate_disc_moments(this->bump_x, this->bump_y, mass, weighted_dx, weighted_dy);
+    return std::pair<double, double>(
+        this->bump_total_dx + weighted_dx / mass,
+        this->bump_total_dy + weighted_dy / mass);
+}
+
+std::pair<double, double> NeuralSheetNetwork::get_bump_position()
+{
+    this->tracker_stamp++;
+    double mass, weighted_dx, weighted_dy;
+    this->calculate_disc_moments(this->bump_x, this->bump_y, mass, weighted_dx, weighted_dy);
+    return std::pair<double, double>(
+        this->bump_x + weighted_dx / mass,
+        this->bump_y + weighted_dy / mass);
+}
+
+void NeuralSheetNetwork::find_bump_centers(std::vector<std::pair<double, double>> &centers)
+{
+    centers.clear();
+    this->tracker_stamp++;
+    PaddedSheet *padded = this->get_padded_activity();
+    const real *activity = this->neurons[current_activity]->values;
+    real max_activation = 0.0;
+    for (int i = 0; i < this->size; i++) {
+        max_activation = MAX(max_activation, activity[i]);
+    }
+    for (int y = 0; y < this->sheet_size; y++) {
+        for (int x = 0; x < this->sheet_size; x++) {
+            real activation = activity[this->coords_to_neuron_index(x, y)];
+            if (activation <= 0.0 || activation < 0.5 * max_activation) {
                 continue;
             }
-            int x = Periodic::modulo(center_x + dx, MEC_SIZE);
-            int y = Periodic::modulo(center_y + dy, MEC_SIZE);
-            int neuron_index = this->coords_to_neuron_index(x, y);
-            real activation = this->neurons[current_activity]->values[neuron_index];
-            mass += activation;
-            weighted_dx += dx * activation;
-            weighted_dy += dy * activation;
+            // Ties go to the neuron that comes first, so that a plateau
+            // yields one bump
+            bool is_maximum = true;
+            for (int dy = -BUMP_TRACKER_RADIUS; is_maximum && dy <= BUMP_TRACKER_RADIUS; dy++) {
+                const real *row = padded->row(Periodic::modulo(y + dy, this->sheet_size));
+                int half_width = this->disc_half_widths[dy + BUMP_TRACKER_RADIUS];
+                for (int dx = -half_width; dx <= half_width; dx++) {
+                    bool before = (dy < 0 || (dy == 0 && dx < 0));
+                    real other = row[x + dx];
+                    if (other > activation || (before && other == activation)) {
+                        is_maximum = false;
+                        break;
+                    }
+                }
+            }
+            if (is_maximum) {
+                double mass, weighted_dx, weighted_dy;
+                this->calculate_disc_moments(x, y, mass, weighted_dx, weighted_dy);
+                centers.push_back(std::pair<double, double>(
+                    x + weighted_dx / mass, y + weighted_dy / mass));
+            }
         }
     }
-    int center_of_mass_dx = round(weighted_dx / mass);
-    int center_of_mass_dy = round(weighted_dy / mass);
-    return std::make_tuple(mass, center_of_mass_dx, center_of_mass_dy);
 }
 
-MecNetwork::MecNetwork(real gain, MecGainMode gain_mode)
-    : NeuralSheetNetwork(gain), gain_mode(gain_mode),
-      activation_probability(gain / MAX_MEC_GAIN)
+void NeuralSheetNetwork::prepare_row(int y)
 {
-    this->add_input(new MecRecurrentInput(this));
+    if (this->row_stamps[y] == this->tracker_stamp) {
+        return;
+    }
+    int row_length = this->sheet_size + 2 * SHEET_HALO + 1;
+    const real *row = this->get_padded_activity()->row(y);
+    double *mass_sums = &this->row_mass_sums[y * row_length];
+    double *moment_sums = &this->row_moment_sums[y * row_length];
+    mass_sums[0] = 0.0;
+    moment_sums[0] = 0.0;
+    for (int x = -SHEET_HALO; x < this->sheet_size + SHEET_HALO; x++) {
+        int i = x + SHEET_HALO;
+        mass_sums[i + 1] = mass_sums[i] + row[x];
+        moment_sums[i + 1] = moment_sums[i] + x * row[x];
+    }
+    this->row_stamps[y] = this->tracker_stamp;
+}
+
+MecNetwork::MecNetwork(int sheet_size, real gain, MecGainMode gain_mode,
+        struct MecCorrelationConf correlation, uint32_t random_stream)
+    : NeuralSheetNetwork(sheet_size, gain), gain_mode(gain_mode),
+      activation_probability(gain / MAX_MEC_GAIN), random_stream(random_stream)
+{
+    this->neurons_enabled = new bool[this->size]();
+    this->enabled_neurons = new int[this->size];
+    this->enabled_count = 0;
+    this->gating_step = 0;
+    this->gating_uniforms = new real[round_up_to_nearest_multiple(this->size, 4)];
+    this->recurrent_input = new MecRecurrentInput(this, correlation);
+    this->add_input(this->recurrent_input);
 }
 
 void MecNetwork::update()
 {
-    for (int i = 0; i < this->size; i++) {
-        if (this->gain_mode == gain_mode_velocity) {
-            this->neurons_enabled[i] = true;
-        } else if (this->gain_mode == gain_mode_poisson_neuron) {
-            this->neurons_enabled[i] = (Random::uniform() < this->activation_probability);
+    this->update_gating();
+    Network::update();
+}
+
+void MecNetwork::update_gating()
+{
+    for (int i = 0; i < this->enabled_count; i++) {
+        this->neurons_enabled[this->enabled_neurons[i]] = false;
+    }
+    this->enabled_count = 0;
+    real probability = this->activation_probability;
+    if (this->gain_mode != gain_mode_poisson_neuron || probability >= 1.0) {
+        for (int i = 0; i < this->size; i++) {
+            this->enabled_neurons[this->enabled_count++] = i;
+        }
+    } else if (probability <= 0.0) {
+        // No neurons enabled
+    } else if (probability > 0.25) {
+        // Each neuron is enabled with the given probability, drawn from the
+        // stream of this network at the current step
+        Random::counter_uniforms(this->random_stream, this->gating_step, 0,
+            round_up_to_nearest_multiple(this->size, 4) / 4, this->gating_uniforms);
+        for (int i = 0; i < this->size; i++) {
+            if (this->gating_uniforms[i] <= probability) {
+                this->enabled_neurons[this->enabled_count++] = i;
+            }
+        }
+    } else {
+        // For small probabilities, jump straight from one enabled neuron to
+        // the next. The gaps between them are geometrically distributed, and
+        // drawing them takes one uniform per enabled neuron rather than one
+        // per neuron. The uniforms are drawn sixteen at a time, as needed
+        real log_complement = log(1.0 - probability);
+        int uniform_count = 0, uniform_index = 0;
+        uint32_t block = 0;
+        for (int i = -1; ; ) {
+            if (uniform_index == uniform_count) {
+                Random::counter_uniforms(this->random_stream, this->gating_step,
+                    block, 4, this->gating_uniforms);
+                block += 4;
+                uniform_count = 16;
+                uniform_index = 0;
+            }
+            real gap = floor(log(this->gating_uniforms[uniform_index++]) / log_complement);
+            if (gap >= this->size - i - 1) {
+                break;
+            }
+            i += 1 + (int)gap;
+            this->enabled_neurons[this->enabled_count++] = i;
         }
     }
-    Network::update();
+    for (int i = 0; i < this->enabled_count; i++) {
+        this->neurons_enabled[this->enabled_neurons[i]] = true;
+    }
+    this->gating_step++;
+}
+
+void MecNetwork::update_fused(const real *velocity_contributions)
+{
+    // Same as update(), for a network whose only inputs are the recurrent
+    // input and a velocity input with the given contributions, and whose
+    // enabled neurons have already been sampled. Instead of clearing the
+    // neuron inputs and letting each input make its own pass over them,
+    // the recurrent sums are gathered and the velocity contributions added
+    // in a single pass, followed by the pass of the leaky rectifier
+    MecRecurrentInput *input = this->recurrent_input;
+    if (!input->correlated_sums_precomputed) {
+        input->correlate();
+    }
+    input->correlated_sums_precomputed = false;
+    // Only the enabled neurons need their inputs, as the others keep their
+    // current activity regardless
+    const int *shift_indices = input->shift_indices;
+    const real *sums = input->correlated_sums;
+    real *neuron_inputs = this->neuron_inputs->values;
+    for (int j = 0; j < this->enabled_count; j++) {
+        int i = this->enabled_neurons[j];
+        neuron_inputs[i] = sums[shift_indices[i]] + velocity_contributions[i];
+    }
+    this->update_neuron_values();
 }
 
 bool MecNetwork::should_update_neuron(int neuron_index)
@@ -126,31 +351,39 @@ bool MecNetwork::should_update_neuron(int neuron_index)
     return this->neurons_enabled[neuron_index];
 }
 
+const int *MecNetwork::get_enabled_neurons(int &count)
+{
+    count = this->enabled_count;
+    return this->enabled_neurons;
+}
+
 void MecNetwork::update_neuron_values()
 {
-    for (int i = 0; i < this->size; i++) {
-        if (this->neurons_enabled[i]) {
-            real input = 1.0 + this->neuron_inputs->values[i];
-            if (input < 0.0) {
-                input = 0.0;
-            }
-            real output_change = (input - this->neurons[current_activity]->values[i]);
-            output_change *= 0.1;
-            this->neurons[next_activity]->values[i] =
-                this->neurons[current_activity]->values[i] + output_change;
-        } else {
-            this->neurons[next_activity]->values[i] =
-                this->neurons[current_activity]->values[i];
-        }
-    }
+    // Enabled neurons move 10% of the way towards their rectified input,
+    // the others keep their current activity
+    Simd::leaky_rectify(
+        this->neuron_inputs->values,
+        this->neurons[current_activity]->values,
+        this->neurons[next_activity]->values,
+        this->neurons_enabled, this->size, 1.0, 0.1);
 }
 
 ConvolvedMecNetwork::ConvolvedMecNetwork(MecNetwork *afferent)
-    : NeuralSheetNetwork(afferent->gain)
+    : NeuralSheetNetwork(afferent->sheet_size, afferent->gain), afferent(afferent)
 {
     this->add_input(new MecConvolveInput(this, afferent));
 }
 
+void ConvolvedMecNetwork::update_fused()
+{
+    // Same as update(), but with the box filter writing straight into the
+    // next activity rather than going through the neuron inputs
+    this->neurons[next_activity]->clear();
+    PaddedSheet *input = this->afferent->get_padded_activity();
+    Simd::box_filter(input->origin, input->stride,
+        this->neurons[next_activity]->values, this->sheet_size, this->sheet_size);
+}
+
 void ConvolvedMecNetwork::update_neuron_values()
 {
     for (int neuron_index = 0; neuron_index < this->size; neuron_index++) {
@@ -159,118 +392,696 @@ void ConvolvedMecNetwork::update_neuron_values()
     }
 }
 
+MecKinematicIntegrator::MecKinematicIntegrator(ConvolvedMecNetwork *network)
+    : rate_x(0.0), rate_y(0.0), offset_x(0.0), offset_y(0.0), network(network)
+{
+    this->template_activity = new Vector(network->size);
+    this->columns = new int[2 * network->sheet_size];
+}
+
+MecKinematicIntegrator::~MecKinematicIntegrator()
+{
+    delete this->template_activity;
+    delete[] this->columns;
+}
+
+void MecKinematicIntegrator::capture_template()
+{
+    this->template_activity->copy_from(this->network->neurons[current_activity]);
+    this->offset_x = 0.0;
+    this->offset_y = 0.0;
+}
+
+void MecKinematicIntegrator::advance(real velocity_x, real velocity_y)
+{
+    int sheet_size = this->network->sheet_size;
+    this->offset_x = Periodic::double_modulo(this->offset_x + this->rate_x * velocity_x, sheet_size);
+    this->offset_y = Periodic::double_modulo(this->offset_y + this->rate_y * velocity_y, sheet_size);
+
+    // The neuron (x, y) takes the template value at (x - offset_x, y -
+    // offset_y), interpolated between the four surrounding neurons, whose
+    // wrapped columns are looked up in a table for the whole step
+    int shift_x = (int)floor(this->offset_x);
+    int shift_y = (int)floor(this->offset_y);
+    real fraction_x = this->offset_x - shift_x;
+    real fraction_y = this->offset_y - shift_y;
+    real weight_00 = (1.0 - fraction_x) * (1.0 - fraction_y);
+    real weight_01 = fraction_x * (1.0 - fraction_y);
+    real weight_10 = (1.0 - fraction_x) * fraction_y;
+    real weight_11 = fraction_x * fraction_y;
+    int *columns = this->columns;
+    int *previous_columns = &this->columns[sheet_size];
+    for (int x = 0; x < sheet_size; x++) {
+        columns[x] = Periodic::modulo(x - shift_x, sheet_size);
+        previous_columns[x] = Periodic::modulo(x - shift_x - 1, sheet_size);
+    }
+    const real *source = this->template_activity->values;
+    real *next = this->network->neurons[next_activity]->values;
+    for (int y = 0; y < sheet_size; y++) {
+        const real *row = &source[Periodic::modulo(y - shift_y, sheet_size) * sheet_size];
+        const real *previous_row = &source[Periodic::modulo(y - shift_y - 1, sheet_size) * sheet_size];
+        real *output = &next[y * sheet_size];
+        for (int x = 0; x < sheet_size; x++) {
+            output[x] =
+                weight_00 * row[columns[x]] + weight_01 * row[previous_columns[x]] +
+                weight_10 * previous_row[columns[x]] + weight_11 * previous_row[previous_columns[x]];
+        }
+    }
+    this->network->commit();
+}
+
 MecConvolveInput::MecConvolveInput(
         ConvolvedMecNetwork *efferent, MecNetwork *afferent)
-    : Input(efferent), efferent(efferent), afferent(afferent)
+    : Input(efferent, afferent), efferent(efferent), afferent(afferent)
 {
 }
 
 void MecConvolveInput::add_inputs()
 {
-    for (int y = 0; y < MEC_SIZE; y++) {
-        for (int x = 0; x < MEC_SIZE; x++) {
-            int afferent_index = this->afferent->coords_to_neuron_index(x, y);
-            real afferent_value = this->afferent->neurons[current_activity]->values[afferent_index];
-            for (int dy = 0; dy < 2; dy++) {
-                for (int dx = 0; dx < 2; dx++) {
-                    int efferent_x = (x + dx) % MEC_SIZE;
-                    int efferent_y = (y + dy) % MEC_SIZE;
-                    int efferent_index = this->efferent->coords_to_neuron_index(efferent_x, efferent_y);
-                    this->efferent->neuron_inputs->values[efferent_index] += 0.25 * afferent_value;
-                }
-            }
-        }
+    // Each afferent neuron (x, y) spreads a quarter of its activity to the
+    // efferent neurons (x, y), (x + 1, y), (x, y + 1) and (x + 1, y + 1).
+    // Seen from the efferent side, this is a 2x2 box filter
+    int sheet_size = this->efferent->sheet_size;
+    PaddedSheet *input = this->afferent->get_padded_activity();
+    Simd::box_filter(input->origin, input->stride,
+        this->efferent->neuron_inputs->values, sheet_size, sheet_size);
+}
+
+std::map<MecKernelKey, MecKernelTables *> MecKernelTables::cache;
+
+MecKernelTables::MecKernelTables(MecKernelKey key)
+    : key(key)
+{
+}
+
+MecKernelTables::~MecKernelTables()
+{
+    delete this->weights;
+    delete this->periodic_correlation;
+    delete this->separable_weights_x;
+    delete this->separable_weights_y;
+    delete this->flipped_weights;
+}
+
+MecKernelTables *MecKernelTables::acquire(MecKernelKey key)
+{
+    MecKernelTables *&tables = MecKernelTables::cache[key];
+    if (tables == nullptr) {
+        tables = new MecKernelTables(key);
+    }
+    tables->references++;
+    return tables;
+}
+
+void MecKernelTables::release(MecKernelTables *tables)
+{
+    if (--tables->references == 0) {
+        MecKernelTables::cache.erase(tables->key);
+        delete tables;
     }
 }
 
 MecShiftedMaskInput::MecShiftedMaskInput(
-        Network *efferent, NeuralSheetNetwork *afferent)
-    : Input(efferent), afferent(afferent)
+        Network *efferent, NeuralSheetNetwork *afferent,
+        struct MecCorrelationConf correlation)
+    : BatchInput(efferent, afferent), afferent(afferent), correlation(correlation)
+{
+}
+
+MecShiftedMaskInput::~MecShiftedMaskInput()
 {
+    // The kernel tables are shared, only the workspaces belong to this input
+    if (this->tables != nullptr) {
+        MecKernelTables::release(this->tables);
+    }
+    delete[] this->shifts;
+    delete[] this->shift_indices;
+    delete[] this->shift_needed;
+    delete[] this->correlation_workspace;
+    delete[] this->correlated_sums;
+    delete[] this->separable_row_sums;
+    delete[] this->active_sources;
+    delete[] this->delta_reference;
 }
 
 void MecShiftedMaskInput::initialize()
 {
-    int w = MEC_SIZE;
-    int h = MEC_SIZE;
-    this->weights = new Matrix(2 * w, 2 * h);
-    for (int y = 0; y < MEC_SIZE; y++) {
-        for (int x = 0; x < MEC_SIZE; x++) {
-            real weight = this->get_weight(x, y);
-            this->weights->values[y + 0][x + 0] = weight;
-            this->weights->values[y + 0][x + w] = weight;
-            this->weights->values[y + h][x + 0] = weight;
-            this->weights->values[y + h][x + w] = weight;
+    int sheet_size = this->afferent->sheet_size;
+    int w = sheet_size;
+    int h = sheet_size;
+    this->tables = MecKernelTables::acquire(this->get_kernel_key());
+    if (this->tables->weights == nullptr) {
+        this->tables->weights = new Matrix(2 * w, 2 * h);
+        for (int y = 0; y < sheet_size; y++) {
+            for (int x = 0; x < sheet_size; x++) {
+                real weight = this->get_weight(x, y);
+                this->tables->weights->values[y + 0][x + 0] = weight;
+                this->tables->weights->values[y + 0][x + w] = weight;
+                this->tables->weights->values[y + h][x + 0] = weight;
+                this->tables->weights->values[y + h][x + w] = weight;
+            }
         }
     }
+    this->weights = this->tables->weights;
     this->shifts = new std::pair<int, int>[this->efferent->size];
+    this->shift_indices = new int[this->efferent->size];
+    for (int neuron_index = 0; neuron_index < this->efferent->size; neuron_index++) {
+        std::pair<int, int> shift = this->get_shift(neuron_index);
+        this->shifts[neuron_index] = shift;
+        this->shift_indices[neuron_index] = shift.second * sheet_size + shift.first;
+    }
+
+    // Count the distinct shifts, which bounds the number of dot products
+    // that the dense engine would need to evaluate in one step
+    std::vector<bool> shift_seen(sheet_size * sheet_size, false);
+    this->distinct_shift_count = 0;
     for (int neuron_index = 0; neuron_index < this->efferent->size; neuron_index++) {
-        this->shifts[neuron_index] = this->get_shift(neuron_index);
+        if (!shift_seen[this->shift_indices[neuron_index]]) {
+            shift_seen[this->shift_indices[neuron_index]] = true;
+            this->distinct_shift_count++;
+        }
+    }
+    if (this->correlation.engine == correlation_engine_auto) {
+        this->correlation.engine = this->choose_engine();
+    }
+
+    this->shift_needed = new bool[sheet_size * sheet_size];
+    this->correlated_sums = new real[sheet_size * sheet_size]();
+    if (this->correlation.engine == correlation_engine_fft) {
+        if (this->tables->periodic_correlation == nullptr) {
+            // The FFT engine wants the unreplicated kernel, with the weight
+            // for the offset (x, y) at row y and column x
+            Matrix kernel(w, h);
+            for (int y = 0; y < sheet_size; y++) {
+                for (int x = 0; x < sheet_size; x++) {
+                    kernel.values[y][x] = this->weights->values[y][x];
+                }
+            }
+            this->tables->periodic_correlation = new PeriodicCorrelation(&kernel);
+        }
+        this->periodic_correlation = this->tables->periodic_correlation;
+        this->correlation_workspace =
+            new complex_real[this->periodic_correlation->workspace_size()];
+    }
+    if (this->correlation.engine == correlation_engine_separable) {
+        this->initialize_separable();
+    }
+    if (this->correlation.engine == correlation_engine_sparse ||
+            this->correlation.engine == correlation_engine_delta) {
+        this->initialize_sparse();
+    }
+    if (this->correlation.engine == correlation_engine_delta) {
+        this->delta_reference = new real[sheet_size * sheet_size];
+    }
+}
+
+void MecShiftedMaskInput::initialize_separable()
+{
+    int sheet_size = this->afferent->sheet_size;
+    int w = sheet_size;
+    int h = sheet_size;
+    if (!this->tables->separable_tabulated) {
+        // Tabulate the rank-1 terms of the kernel, replicated twice along
+        // their axis like the weights matrix above, so that shifted profiles
+        // can be read without wrapping the indices
+        int terms = this->get_separable_term_count();
+        Matrix *weights_x = new Matrix(2 * w, MAX(terms, 1));
+        Matrix *weights_y = new Matrix(2 * h, MAX(terms, 1));
+        for (int term = 0; term < terms; term++) {
+            for (int x = 0; x < w; x++) {
+                real weight = this->get_separable_weight_x(term, x);
+                weights_x->values[term][x + 0] = weight;
+                weights_x->values[term][x + w] = weight;
+            }
+            for (int y = 0; y < h; y++) {
+                real weight = this->get_separable_weight_y(term, y);
+                weights_y->values[term][y + 0] = weight;
+                weights_y->values[term][y + h] = weight;
+            }
+        }
+
+        // Verify that the declared terms actually add up to the kernel, and
+        // only record the terms for kernels that are (declared to be) separable
+        real max_weight = 0.0, max_error = 0.0;
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                real weight = 0.0;
+                for (int term = 0; term < terms; term++) {
+                    weight += weights_x->values[term][x] * weights_y->values[term][y];
+                }
+                max_weight = MAX(max_weight, std::abs(this->weights->values[y][x]));
+                max_error = MAX(max_error, std::abs(this->weights->values[y][x] - weight));
+            }
+        }
+        if (terms == 0 || max_error > 1e-5 * max_weight) {
+            std::cerr << "Warning: Kernel is not separable, "
+                << "using the dense correlation engine instead" << std::endl;
+            delete weights_x;
+            delete weights_y;
+        } else {
+            this->tables->separable_terms = terms;
+            this->tables->separable_weights_x = weights_x;
+            this->tables->separable_weights_y = weights_y;
+        }
+        this->tables->separable_tabulated = true;
+    }
+
+    // Fall back to the dense engine for kernels that are not separable
+    if (this->tables->separable_terms == 0) {
+        this->correlation.engine = correlation_engine_dense;
+        return;
+    }
+    this->separable_terms = this->tables->separable_terms;
+    this->separable_weights_x = this->tables->separable_weights_x;
+    this->separable_weights_y = this->tables->separable_weights_y;
+    this->separable_row_sums = new real[sheet_size * sheet_size];
+}
+
+void MecShiftedMaskInput::initialize_sparse()
+{
+    int sheet_size = this->afferent->sheet_size;
+    int w = sheet_size;
+    int h = sheet_size;
+    if (this->tables->flipped_weights == nullptr) {
+        // The scatter kernel adds the kernel as seen from each active
+        // afferent neuron, i.e. with both offsets negated. The flipped kernel
+        // is also replicated, such that each of its rows can be read
+        // contiguously
+        this->tables->flipped_weights = new Matrix(2 * w, 2 * h);
+        for (int y = 0; y < 2 * h; y++) {
+            for (int x = 0; x < 2 * w; x++) {
+                this->tables->flipped_weights->values[y][x] =
+                    this->weights->values[(2 * h - y) % h][(2 * w - x) % w];
+            }
+        }
     }
+    this->flipped_weights = this->tables->flipped_weights;
+    this->active_sources = new int[sheet_size * sheet_size];
+}
+
+MecCorrelationEngine MecShiftedMaskInput::choose_engine()
+{
+    // When enough of the efferent neurons have distinct shifts, correlating
+    // the whole sheet once and gathering the sums of the needed shifts from
+    // the result is cheaper than one dense dot product per distinct shift
+    int sheet_size = this->afferent->sheet_size;
+    if (this->distinct_shift_count > AUTO_FFT_SHIFT_FRACTION * sheet_size * sheet_size) {
+        return correlation_engine_fft;
+    }
+    return correlation_engine_dense;
 }
 
 void MecShiftedMaskInput::add_inputs()
 {
+    // A memoized contribution is only recalculated when the afferent sheet
+    // has changed since it was last correlated
+    if (this->memoized_contribution != nullptr) {
+        this->get_memoized_contribution();
+        this->add_memoized_contribution();
+        return;
+    }
+
+    // The sums may already have been calculated for this step by a
+    // MecRecurrentBatch, in which case they only need to be gathered
+    if (!this->correlated_sums_precomputed) {
+        this->correlate();
+    }
+    this->correlated_sums_precomputed = false;
+    this->add_correlated_sums(this->efferent->neuron_inputs->values);
+}
+
+const real *MecShiftedMaskInput::get_memoized_contribution()
+{
+    if (this->memoized_contribution_outdated()) {
+        this->correlate();
+        this->memoized_contribution->clear();
+        this->add_correlated_sums(this->memoized_contribution->values);
+    }
+    return this->memoized_contribution->values;
+}
+
+void MecShiftedMaskInput::add_inputs_batch(const real *const *afferent_activities, int count,
+        real *const *destinations)
+{
+    // Calculate the sums for all sheets into local buffers, rather than into
+    // the buffers of the input. The FFT engine correlates each sheet as a
+    // whole, while any other engine evaluates each distinct shift needed by
+    // an enabled efferent neuron densely, for all of the sheets at once
+    int sheet_size = this->afferent->sheet_size;
+    int shift_count = sheet_size * sheet_size;
+    std::vector<real> sums(count * shift_count);
+    int enabled_count;
+    const int *enabled_neurons = this->efferent->get_enabled_neurons(enabled_count);
+    if (this->correlation.engine == correlation_engine_fft) {
+        std::vector<complex_real> workspace(this->periodic_correlation->workspace_size());
+        for (int sheet = 0; sheet < count; sheet++) {
+            this->periodic_correlation->correlate(afferent_activities[sheet],
+                &sums[sheet * shift_count], workspace.data());
+        }
+    } else {
+        std::vector<bool> shift_done(shift_count, false);
+        std::vector<real> shift_sums(count);
+        for (int j = 0; j < enabled_count; j++) {
+            int efferent_neuron = enabled_neurons[j];
+            int shift_index = this->shift_indices[efferent_neuron];
+            if (shift_done[shift_index]) {
+                continue;
+            }
+            std::pair<int, int> shift = this->shifts[efferent_neuron];
+            Simd::shifted_dot_batch(afferent_activities, count,
+                &this->weights->values[sheet_size - shift.second][sheet_size - shift.first],
+                sheet_size, sheet_size, sheet_size * 2, shift_sums.data());
+            for (int sheet = 0; sheet < count; sheet++) {
+                sums[sheet * shift_count + shift_index] = shift_sums[sheet];
+            }
+            shift_done[shift_index] = true;
+        }
+    }
+    for (int sheet = 0; sheet < count; sheet++) {
+        const real *sheet_sums = &sums[sheet * shift_count];
+        for (int j = 0; j < enabled_count; j++) {
+            int efferent_neuron = enabled_neurons[j];
+            destinations[sheet][efferent_neuron] +=
+                sheet_sums[this->shift_indices[efferent_neuron]];
+        }
+    }
+}
+
+void MecShiftedMaskInput::correlate()
+{
+    switch (this->correlation.engine) {
+    case correlation_engine_dense: this->correlate_dense(); break;
+    case correlation_engine_fft: this->correlate_fft(); break;
+    case correlation_engine_separable: this->correlate_separable(); break;
+    case correlation_engine_sparse: this->correlate_sparse(); break;
+    case correlation_engine_delta: this->correlate_delta(); break;
+    default: break;
+    }
+}
+
+void MecShiftedMaskInput::correlate_dense()
+{
+    int sheet_size = this->afferent->sheet_size;
     // Each efferent neuron can separately specify its desired shift of the
     // connectivity profile. For MEC neurons this will be their own locations
     // in the neural sheet plus their directional-preference-offset, while for
     // MEC-diff neurons this depends on their sampled (x, y, direction) tuple.
-    // Because multiple efferent neurons can share the same origin, we cache
-    // the sum for each given origin. This cached sum is only considered valid
-    // during the current execution of this method, therefore we reset the
-    // cache validity here at the beginning of the method.
-    for (int y = 0; y < MEC_SIZE; y++) {
-        for (int x = 0; x < MEC_SIZE; x++) {
-            this->cached_sum_valid[y][x] = false;
+    // Because multiple efferent neurons can share the same origin, the sum
+    // for each origin is only calculated once. Whether a sum has been
+    // calculated is only tracked during the current execution of this
+    // method, therefore we reset the flags here at the beginning.
+    for (int i = 0; i < sheet_size * sheet_size; i++) {
+        this->shift_needed[i] = false;
+    }
+    int enabled_count;
+    const int *enabled_neurons = this->efferent->get_enabled_neurons(enabled_count);
+    for (int j = 0; j < enabled_count; j++) {
+        int efferent_neuron = enabled_neurons[j];
+        int shift_index = this->shift_indices[efferent_neuron];
+        if (this->shift_needed[shift_index]) {
+            continue;
+        }
+        std::pair<int, int> shift = this->shifts[efferent_neuron];
+        int shift_x = sheet_size - shift.first;
+        int shift_y = sheet_size - shift.second;
+
+        this->correlated_sums[shift_index] = Simd::shifted_dot(
+            this->afferent->neurons[current_activity]->values,
+            &this->weights->values[shift_y][shift_x],
+            sheet_size, sheet_size, sheet_size * 2);
+        this->shift_needed[shift_index] = true;
+    }
+}
+
+void MecShiftedMaskInput::correlate_fft()
+{
+    // Rather than evaluating one dot product per distinct shift, calculate
+    // the sums for all sheet_size * sheet_size possible shifts at once as the
+    // periodic cross-correlation of the afferent sheet with the kernel
+    this->periodic_correlation->correlate(
+        this->afferent->neurons[current_activity]->values,
+        this->correlated_sums, this->correlation_workspace);
+}
+
+void MecShiftedMaskInput::correlate_separable()
+{
+    int sheet_size = this->afferent->sheet_size;
+    // For a kernel w(x, y) = sum_t a_t(x) * b_t(y), the sum for the shift
+    // (sx, sy) factors into a row pass
+    //     R_t[y][sx] = sum_x neurons[y][x] * a_t(x - sx)
+    // followed by a column pass
+    //     sum[sy][sx] = sum_t sum_y b_t(y - sy) * R_t[y][sx],
+    // which takes O(sheet_size^3) rather than O(sheet_size^4) operations for all
+    // shifts together
+    const real *neurons = this->afferent->neurons[current_activity]->values;
+    for (int i = 0; i < sheet_size * sheet_size; i++) {
+        this->correlated_sums[i] = 0.0;
+    }
+    for (int term = 0; term < this->separable_terms; term++) {
+        real *weights_x = this->separable_weights_x->values[term];
+        real *weights_y = this->separable_weights_y->values[term];
+        for (int y = 0; y < sheet_size; y++) {
+            for (int shift_x = 0; shift_x < sheet_size; shift_x++) {
+                this->separable_row_sums[y * sheet_size + shift_x] = Simd::shifted_dot(
+                    &neurons[y * sheet_size], &weights_x[sheet_size - shift_x], sheet_size, 1, 0);
+            }
+        }
+        for (int shift_y = 0; shift_y < sheet_size; shift_y++) {
+            real *weights = &weights_y[sheet_size - shift_y];
+            real *sums = &this->correlated_sums[shift_y * sheet_size];
+            for (int y = 0; y < sheet_size; y++) {
+                Simd::axpy(sums, &this->separable_row_sums[y * sheet_size], weights[y], sheet_size);
+            }
+        }
+    }
+}
+
+void MecShiftedMaskInput::correlate_sparse()
+{
+    int sheet_size = this->afferent->sheet_size;
+    // Collect the afferent neurons whose activity exceeds the threshold.
+    // Outside of the activity bumps, most of the sheet is (close to) zero
+    const real *neurons = this->afferent->neurons[current_activity]->values;
+    int active_count = 0;
+    for (int i = 0; i < sheet_size * sheet_size; i++) {
+        if (std::abs(neurons[i]) > this->correlation.sparse_threshold) {
+            this->active_sources[active_count++] = i;
+        }
+    }
+
+    // Both engines cost about sheet_size^2 operations per unit of work, which
+    // is one active afferent neuron for the scatter, and one distinct shift
+    // of an efferent neuron to be updated for the dense gather. Fall back to
+    // the latter when it has less work to do
+    int efferent_count;
+    this->efferent->get_enabled_neurons(efferent_count);
+    if (active_count >= MIN(efferent_count, this->distinct_shift_count)) {
+        this->correlate_dense();
+        return;
+    }
+
+    // Scatter the flipped kernel, centered at each active afferent neuron,
+    // into the sums for all shifts
+    for (int i = 0; i < sheet_size * sheet_size; i++) {
+        this->correlated_sums[i] = 0.0;
+    }
+    for (int source = 0; source < active_count; source++) {
+        int source_index = this->active_sources[source];
+        this->scatter(source_index, neurons[source_index]);
+    }
+}
+
+void MecShiftedMaskInput::scatter(int source_index, real value)
+{
+    int sheet_size = this->afferent->sheet_size;
+    int source_x = this->afferent->neuron_index_to_x(source_index);
+    int source_y = this->afferent->neuron_index_to_y(source_index);
+    for (int shift_y = 0; shift_y < sheet_size; shift_y++) {
+        Simd::axpy(
+            &this->correlated_sums[shift_y * sheet_size],
+            &this->flipped_weights->values[shift_y - source_y + sheet_size][sheet_size - source_x],
+            value, sheet_size);
+    }
+}
+
+int MecShiftedMaskInput::delta_refresh_count = 0;
+double MecShiftedMaskInput::delta_max_error = 0.0;
+double MecShiftedMaskInput::delta_squared_error = 0.0;
+double MecShiftedMaskInput::delta_squared_sum = 0.0;
+std::mutex MecShiftedMaskInput::delta_error_mutex;
+
+void MecShiftedMaskInput::correlate_delta()
+{
+    int sheet_size = this->afferent->sheet_size;
+    const real *neurons = this->afferent->neurons[current_activity]->values;
+    if (!this->delta_initialized) {
+        this->correlate_all_shifts(false);
+        this->delta_initialized = true;
+        return;
+    }
+
+    // The sums are linear in the afferent activity, so they can be brought
+    // up to date by scattering the change of each afferent neuron since it
+    // was last propagated. Changes below the threshold are held back until
+    // they have accumulated above it, which bounds the error of each sum by
+    // the threshold times the total kernel weight
+    real *reference = this->delta_reference;
+    int changed_count = 0;
+    for (int i = 0; i < sheet_size * sheet_size; i++) {
+        if (std::abs(neurons[i] - reference[i]) > this->correlation.delta_threshold) {
+            this->active_sources[changed_count++] = i;
         }
     }
+    this->delta_steps_since_refresh++;
+    bool refresh = (this->delta_steps_since_refresh >= this->correlation.delta_refresh_interval);
+    if (!refresh && changed_count >= this->distinct_shift_count) {
+        // Propagating the changes would cost more than an exact recompute
+        this->correlate_all_shifts(false);
+        return;
+    }
+    for (int changed = 0; changed < changed_count; changed++) {
+        int source_index = this->active_sources[changed];
+        this->scatter(source_index, neurons[source_index] - reference[source_index]);
+        reference[source_index] = neurons[source_index];
+    }
+
+    // Every so often, replace the propagated sums by the exact ones to keep
+    // the rounding errors from piling up, and measure how far off they were
+    if (refresh) {
+        this->correlate_all_shifts(true);
+    }
+}
+
+void MecShiftedMaskInput::correlate_all_shifts(bool measure_error)
+{
+    int sheet_size = this->afferent->sheet_size;
+    const real *neurons = this->afferent->neurons[current_activity]->values;
+    // Unlike the dense engine, the sums for the shifts of all efferent
+    // neurons are needed, not only of those enabled in this step
+    for (int i = 0; i < sheet_size * sheet_size; i++) {
+        this->shift_needed[i] = false;
+    }
+    double max_error = 0.0, squared_error = 0.0, squared_sum = 0.0;
     for (int efferent_neuron = 0; efferent_neuron < this->efferent->size; efferent_neuron++) {
-        if (!this->efferent->should_update_neuron(efferent_neuron)) {
+        int shift_index = this->shift_indices[efferent_neuron];
+        if (this->shift_needed[shift_index]) {
             continue;
         }
         std::pair<int, int> shift = this->shifts[efferent_neuron];
-        if (this->cached_sum_valid[shift.second][shift.first]) {
-            this->efferent->neuron_inputs->values[efferent_neuron] +=
-                this->cached_sums[shift.second][shift.first];
-            continue;
+        real sum = Simd::shifted_dot(neurons,
+            &this->weights->values[sheet_size - shift.second][sheet_size - shift.first],
+            sheet_size, sheet_size, sheet_size * 2);
+        if (measure_error) {
+            double error = std::abs(this->correlated_sums[shift_index] - sum);
+            max_error = MAX(max_error, error);
+            squared_error += error * error;
+            squared_sum += (double)sum * sum;
         }
-        int shift_x = MEC_SIZE - shift.first;
-        int shift_y = MEC_SIZE - shift.second;
+        this->correlated_sums[shift_index] = sum;
+        this->shift_needed[shift_index] = true;
+    }
+    if (measure_error) {
+        // The modules may settle on separate threads
+        std::lock_guard<std::mutex> lock(MecShiftedMaskInput::delta_error_mutex);
+        MecShiftedMaskInput::delta_max_error = MAX(MecShiftedMaskInput::delta_max_error, max_error);
+        MecShiftedMaskInput::delta_squared_error += squared_error;
+        MecShiftedMaskInput::delta_squared_sum += squared_sum;
+        MecShiftedMaskInput::delta_refresh_count++;
+    }
+    Simd::copy(this->delta_reference, neurons, sheet_size * sheet_size);
+    this->delta_steps_since_refresh = 0;
+}
 
-        real sum = 0.0;
-        aligned_real *neurons = this->afferent->neurons[current_activity]->values;
-        real *weights = &this->weights->values[shift_y][shift_x];
-        for (int y = 0; y < MEC_SIZE; y++) {
-            for (int x = 0; x < MEC_SIZE; x++) {
-                sum += neurons[x] * weights[x];
-            }
-            neurons += MEC_SIZE;
-            weights += MEC_SIZE * 2;
-        }
-        this->efferent->neuron_inputs->values[efferent_neuron] += sum;
-        this->cached_sums[shift.second][shift.first] = sum;
-        this->cached_sum_valid[shift.second][shift.first] = true;
+void MecShiftedMaskInput::report_delta_error(std::ostream &stream)
+{
+    stream << "Delta engine error over " << MecShiftedMaskInput::delta_refresh_count
+        << " refreshes: max absolute " << MecShiftedMaskInput::delta_max_error
+        << ", relative RMS ";
+    if (MecShiftedMaskInput::delta_squared_sum > 0.0) {
+        stream << sqrt(MecShiftedMaskInput::delta_squared_error /
+            MecShiftedMaskInput::delta_squared_sum);
+    } else {
+        stream << 0.0;
     }
+    stream << std::endl;
 }
 
-MecRecurrentInput::MecRecurrentInput(MecNetwork *network)
-    : MecShiftedMaskInput(network, network), afferent(network)
+void MecShiftedMaskInput::add_correlated_sums(real *destination)
 {
+    int enabled_count;
+    const int *enabled_neurons = this->efferent->get_enabled_neurons(enabled_count);
+    for (int j = 0; j < enabled_count; j++) {
+        int efferent_neuron = enabled_neurons[j];
+        destination[efferent_neuron] +=
+            this->correlated_sums[this->shift_indices[efferent_neuron]];
+    }
+}
+
+MecRecurrentInput::MecRecurrentInput(MecNetwork *network,
+        struct MecCorrelationConf correlation)
+    : MecShiftedMaskInput(network, network, correlation), afferent(network)
+{
+}
+
+MecCorrelationEngine MecRecurrentInput::choose_engine()
+{
+    // Only the shifts of the neurons enabled by the gating are needed in each
+    // step, and with the dense engine the modules can share their passes
+    // over the weights in a MecRecurrentBatch
+    return correlation_engine_dense;
+}
+
+MecKernelKey MecRecurrentInput::get_kernel_key()
+{
+    return MecKernelKey("recurrent", {
+        (real)this->afferent->sheet_size, this->afferent->beta, this->afferent->gamma });
 }
 
 real MecRecurrentInput::get_weight(int x, int y)
 {
-    if (x > MEC_SIZE / 2) {
-        x = MEC_SIZE - x;
+    if (x > this->afferent->sheet_size / 2) {
+        x = this->afferent->sheet_size - x;
     }
-    if (y > MEC_SIZE / 2) {
-        y = MEC_SIZE - y;
+    if (y > this->afferent->sheet_size / 2) {
+        y = this->afferent->sheet_size - y;
     }
     real distance_squared = x * x + y * y;
     return exp(-this->afferent->gamma * distance_squared)
          - exp(-this->afferent->beta  * distance_squared);
 }
 
+int MecRecurrentInput::get_separable_term_count()
+{
+    return 2;
+}
+
+real MecRecurrentInput::get_separable_weight_x(int term, int x)
+{
+    // exp(-gamma * (x^2 + y^2)) - exp(-beta * (x^2 + y^2)) is the sum of
+    // the rank-1 terms exp(-gamma * x^2) * exp(-gamma * y^2) and
+    // -exp(-beta * x^2) * exp(-beta * y^2)
+    if (x > this->afferent->sheet_size / 2) {
+        x = this->afferent->sheet_size - x;
+    }
+    if (term == 0) {
+        return exp(-this->afferent->gamma * x * x);
+    } else {
+        return -exp(-this->afferent->beta * x * x);
+    }
+}
+
+real MecRecurrentInput::get_separable_weight_y(int term, int y)
+{
+    if (y > this->afferent->sheet_size / 2) {
+        y = this->afferent->sheet_size - y;
+    }
+    if (term == 0) {
+        return exp(-this->afferent->gamma * y * y);
+    } else {
+        return exp(-this->afferent->beta * y * y);
+    }
+}
+
 std::pair<int, int> MecRecurrentInput::get_shift(int neuron_index)
 {
     int x = this->afferent->neuron_index_to_x(neuron_index);
@@ -281,15 +1092,135 @@ std::pair<int, int> MecRecurrentInput::get_shift(int neuron_index)
     case east: x--; break;
     case west: x++; break;
     }
-    x = Periodic::modulo(x, MEC_SIZE);
-    y = Periodic::modulo(y, MEC_SIZE);
+    x = Periodic::modulo(x, this->afferent->sheet_size);
+    y = Periodic::modulo(y, this->afferent->sheet_size);
     return std::pair<int, int>(x, y);
 }
 
+MecRecurrentBatch::MecRecurrentBatch(std::vector<MecNetwork *> networks)
+    : networks(networks), sheet_size(networks[0]->sheet_size)
+{
+    // Batching requires all networks to use the dense engine on the very
+    // same kernel tables, which also implies the same sheet size
+    this->batched = true;
+    for (MecNetwork *network : this->networks) {
+        MecRecurrentInput *input = network->recurrent_input;
+        this->batched &= (input->correlation.engine == correlation_engine_dense);
+        this->batched &= (input->tables == this->networks[0]->recurrent_input->tables);
+    }
+    int count = this->networks.size();
+    this->shift_needed = new bool[count * this->sheet_size * this->sheet_size];
+    this->shift_sheet_counts = new int[this->sheet_size * this->sheet_size];
+    this->shift_sheets = new const real *[this->sheet_size * this->sheet_size * count];
+    this->shift_outputs = new real *[this->sheet_size * this->sheet_size * count];
+}
+
+void MecRecurrentBatch::correlate(ThreadPool *pool)
+{
+    // Sample which neurons to update in every network. Each network draws
+    // from its own stream, so this can be done in parallel
+    int count = this->networks.size();
+    ThreadPool::run_on(pool, count, [this](int sheet) {
+        if (!this->networks[sheet]->quiescent) {
+            this->networks[sheet]->update_gating();
+        }
+    });
+    if (!this->batched) {
+        ThreadPool::run_on(pool, count, [this](int sheet) {
+            MecNetwork *network = this->networks[sheet];
+            if (network->quiescent) {
+                return;
+            }
+            network->recurrent_input->correlate();
+            network->recurrent_input->correlated_sums_precomputed = true;
+        });
+        return;
+    }
+
+    // Collect for each shift the sheets that have an enabled neuron needing it
+    for (int i = 0; i < count * this->sheet_size * this->sheet_size; i++) {
+        this->shift_needed[i] = false;
+    }
+    for (int i = 0; i < this->sheet_size * this->sheet_size; i++) {
+        this->shift_sheet_counts[i] = 0;
+    }
+    for (int sheet = 0; sheet < count; sheet++) {
+        MecNetwork *network = this->networks[sheet];
+        MecRecurrentInput *input = network->recurrent_input;
+        if (network->quiescent) {
+            continue;
+        }
+        bool *needed = &this->shift_needed[sheet * this->sheet_size * this->sheet_size];
+        for (int j = 0; j < network->enabled_count; j++) {
+            int neuron_index = network->enabled_neurons[j];
+            int shift_index = input->shift_indices[neuron_index];
+            if (needed[shift_index]) {
+                continue;
+            }
+            needed[shift_index] = true;
+            int slot = shift_index * count + this->shift_sheet_counts[shift_index]++;
+            this->shift_sheets[slot] = network->neurons[current_activity]->values;
+            this->shift_outputs[slot] = &input->correlated_sums[shift_index];
+        }
+    }
+
+    this->needed_shifts.clear();
+    for (int shift_index = 0; shift_index < this->sheet_size * this->sheet_size; shift_index++) {
+        if (this->shift_sheet_counts[shift_index] > 0) {
+            this->needed_shifts.push_back(shift_index);
+        }
+    }
+
+    // Evaluate all needed sums, one window of weights at a time. The shifts
+    // write to separate sums, so they are split evenly between the threads,
+    // which gives the same sums whatever the number of threads
+    int task_count = pool != nullptr ? pool->thread_count : 1;
+    ThreadPool::run_on(pool, task_count, [this, count, task_count](int task) {
+        Matrix *weights = this->networks[0]->recurrent_input->weights;
+        std::vector<real> sums(count);
+        int shift_count = this->needed_shifts.size();
+        int first = (long)shift_count * task / task_count;
+        int last = (long)shift_count * (task + 1) / task_count;
+        for (int i = first; i < last; i++) {
+            int shift_index = this->needed_shifts[i];
+            int sheet_count = this->shift_sheet_counts[shift_index];
+            int shift_x = this->sheet_size - shift_index % this->sheet_size;
+            int shift_y = this->sheet_size - shift_index / this->sheet_size;
+            Simd::shifted_dot_batch(
+                &this->shift_sheets[shift_index * count], sheet_count,
+                &weights->values[shift_y][shift_x],
+                this->sheet_size, this->sheet_size, this->sheet_size * 2, sums.data());
+            for (int sheet = 0; sheet < sheet_count; sheet++) {
+                *this->shift_outputs[shift_index * count + sheet] = sums[sheet];
+            }
+        }
+    });
+    for (MecNetwork *network : this->networks) {
+        network->recurrent_input->correlated_sums_precomputed = !network->quiescent;
+    }
+}
+
+void MecRecurrentBatch::update()
+{
+    // Let the networks run their ordinary update on top of the precomputed
+    // sums, without sampling the enabled neurons once more
+    this->correlate();
+    for (MecNetwork *network : this->networks) {
+        network->Network::update();
+    }
+}
+
+void MecRecurrentBatch::commit()
+{
+    for (MecNetwork *network : this->networks) {
+        network->commit();
+    }
+}
+
 MecNetworkPlot::MecNetworkPlot(NeuralSheetNetwork *network, int number)
     : network(network)
 {
-    std::string plot_range = "[-0.5:" + std::to_string(MEC_SIZE - 1) + ".5]";
+    std::string plot_range = "[-0.5:" + std::to_string(network->sheet_size - 1) + ".5]";
     this->set("xrange", plot_range.c_str());
     this->set("yrange", plot_range.c_str());
     this->set("size", "square");
@@ -321,10 +1252,11 @@ MecNetworkPlot::MecNetworkPlot(NeuralSheetNetwork *network, int number)
 
 void MecNetworkPlot::dump_plot_commands(std::ostream &stream)
 {
+    int sheet_size = this->network->sheet_size;
     int origin_bump_x = Periodic::modulo(
-        this->network->bump_x - this->network->bump_total_dx, MEC_SIZE);
+        this->network->bump_x - this->network->bump_total_dx, sheet_size);
     int origin_bump_y = Periodic::modulo(
-        this->network->bump_y - this->network->bump_total_dy, MEC_SIZE);
+        this->network->bump_y - this->network->bump_total_dy, sheet_size);
     int bump_radius = BUMP_TRACKER_RADIUS;
 
     stream << "set object 1 circle at " << origin_bump_x << "," << origin_bump_y
@@ -340,8 +1272,8 @@ void MecNetworkPlot::dump_plot_commands(std::ostream &stream)
     stream << "plot '-' matrix with image notitle, "
            << "'-' with vectors nohead lc rgb 'black' lw 4 notitle, "
            << "'-' with vectors nohead lc rgb 'white' lw 2 notitle;" << std::endl;
-    for (int y = 0; y < MEC_SIZE; y++) {
-        for (int x = 0; x < MEC_SIZE; x++) {
+    for (int y = 0; y < sheet_size; y++) {
+        for (int x = 0; x < sheet_size; x++) {
             int neuron_index = this->network->coords_to_neuron_index(x, y);
             stream << this->network->neurons[current_activity]->values[neuron_index] << " ";
         }
@@ -363,10 +1295,10 @@ void MecNetworkPlot::dump_plot_commands(std::ostream &stream)
             double dy = length * sin(direction);
 
             double t[] = {
-                dx >= 0 ? HUGE_VAL :          (- 0.5 - x) / dx, // Left
-                dx <= 0 ? HUGE_VAL : (MEC_SIZE - 0.5 - x) / dx, // Right
-                dy >= 0 ? HUGE_VAL :          (- 0.5 - y) / dy, // Bottom
-                dy <= 0 ? HUGE_VAL : (MEC_SIZE - 0.5 - y) / dy, // Top
+                dx >= 0 ? HUGE_VAL :            (- 0.5 - x) / dx, // Left
+                dx <= 0 ? HUGE_VAL : (sheet_size - 0.5 - x) / dx, // Right
+                dy >= 0 ? HUGE_VAL :            (- 0.5 - y) / dy, // Bottom
+                dy <= 0 ? HUGE_VAL : (sheet_size - 0.5 - y) / dy, // Top
             };
             double min_t = HUGE_VAL;
             double segment_length = length;
@@ -387,10 +1319,10 @@ void MecNetworkPlot::dump_plot_commands(std::ostream &stream)
             for (int t_index = 0; t_index < 4; t_index++) {
                 if (t[t_index] == min_t) {
                     switch (t_index) {
-                    case 0: x += MEC_SIZE; break; // Hit left wall, jump to right wall
-                    case 1: x -= MEC_SIZE; break; // Hit right wall, jump to left wall
-                    case 2: y += MEC_SIZE; break; // Hit bottom wall, jump to top wall
-                    case 3: y -= MEC_SIZE; break; // Hit top wall, jump to bottom wall
+                    case 0: x += sheet_size; break; // Hit left wall, jump to right wall
+                    case 1: x -= sheet_size; break; // Hit right wall, jump to left wall
+                    case 2: y += sheet_size; break; // Hit bottom wall, jump to top wall
+                    case 3: y -= sheet_size; break; // Hit top wall, jump to bottom wall
                     }
                 }
             }
@@ -8,66 +8,147 @@
 #ifndef MEC_H_INCLUDED
 #define MEC_H_INCLUDED
 
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
 #include <tuple>
+#include <vector>
 
 #include "network.h"
+#include "parallel.h"
 #include "plot.h"
 #include "main.h"
 
 class MecRecurrentInput;
+class MecRecurrentBatch;
 
 enum MecDirectionality { west, north, south, east };
 
 class NeuralSheetNetwork : public Network
 {
     public:
-        NeuralSheetNetwork(real gain);
+        NeuralSheetNetwork(int sheet_size, real gain);
 
+        int sheet_size;
         real gain;
         real lambda, beta, gamma;
 
-        inline int neuron_index_to_x(int i) { return i % MEC_SIZE; }
-        inline int neuron_index_to_y(int i) { return i / MEC_SIZE; }
-        inline int coords_to_neuron_index(int x, int y) { return y * MEC_SIZE + x; }
+        inline int neuron_index_to_x(int i) { return i % this->sheet_size; }
+        inline int neuron_index_to_y(int i) { return i / this->sheet_size; }
+        inline int coords_to_neuron_index(int x, int y) { return y * this->sheet_size + x; }
 
         int bump_x, bump_y;
         int bump_total_dx = 0, bump_total_dy = 0;
         bool bump_tracker_initialized;
         void initialize_bump_tracker();
         void update_bump_tracker();
+        // The total displacement of the bump since the tracker was
+        // initialized, including the sub-neuron offset of its center of mass
+        std::pair<double, double> get_bump_displacement();
+        // The position of the tracked bump, including its sub-neuron offset
+        std::pair<double, double> get_bump_position();
+        // The centers of mass of all bumps of the sheet, i.e. of the neurons
+        // whose activity is the largest within the tracker radius and at
+        // least half of the largest activity of the sheet
+        void find_bump_centers(std::vector<std::pair<double, double>> &centers);
+
+        // The current activity with a halo of SHEET_HALO cells, refreshed on
+        // first use after each change of the activity
+        void activity_changed();
+        real get_max_change();
+        PaddedSheet *get_padded_activity();
 
     protected:
+        PaddedSheet *padded_activity;
+        bool padded_activity_stale;
+
         std::tuple<real, int, int> calculate_disc_mass(int center_x, int center_y);
+        void calculate_disc_moments(int center_x, int center_y,
+            double &mass, double &weighted_dx, double &weighted_dy);
+
+        // The disc is stored as the half width of each of its rows, and the
+        // rows of the padded sheet as prefix sums of activity and of activity
+        // times x, so that the mass and moments of each row of the disc are
+        // differences of two prefix sums. The prefix sums are built lazily
+        // for the rows that the tracker visits, once per update
+        std::vector<int> disc_half_widths;
+        std::vector<double> row_mass_sums;
+        std::vector<double> row_moment_sums;
+        std::vector<int> row_stamps;
+        int tracker_stamp;
+        void prepare_row(int y);
 };
 
 class MecNetwork : public NeuralSheetNetwork
 {
     public:
-        MecNetwork(real gain, MecGainMode gain_mode);
+        MecNetwork(int sheet_size, real gain, MecGainMode gain_mode,
+            struct MecCorrelationConf correlation, uint32_t random_stream);
         MecGainMode gain_mode;
         real activation_probability;
+        uint32_t random_stream;
+        // Set while the sheet has converged and the agent is at rest, in
+        // which case the sheet is left as it is rather than updated
+        bool quiescent = false;
+        // Step counter of the gating, which selects the uniforms it draws
+        uint64_t gating_step;
 
         void update();
+        void update_gating();
+        void update_fused(const real *velocity_contributions);
         bool should_update_neuron(int neuron_index);
+        const int *get_enabled_neurons(int &count);
 
         inline MecDirectionality directionality(int x, int y) {
             return (MecDirectionality)(2 * (y % 2) + (x % 2)); }
 
     protected:
+        friend class MecRecurrentBatch;
+
         void update_neuron_values();
         MecRecurrentInput *recurrent_input;
-        bool neurons_enabled[MEC_SIZE * MEC_SIZE];
+        // The enabled neurons, both as flags and as a list of indices
+        bool *neurons_enabled;
+        int *enabled_neurons;
+        int enabled_count;
+        // Buffer for the uniforms drawn by the gating
+        real *gating_uniforms;
 };
 
 class ConvolvedMecNetwork : public NeuralSheetNetwork
 {
     public:
        ConvolvedMecNetwork(MecNetwork *afferent);
+       void update_fused();
 
     protected:
+        MecNetwork *afferent;
         void update_neuron_values();
 };
 
+// Stand-in for the attractor dynamics of a grid module in the kinematic gain
+// mode. The convolved sheet of the module is captured once as a template, and
+// each step shifts the template by the integrated velocity, scaled by the
+// bump velocity per unit of speed measured from the actual dynamics, with
+// bilinear interpolation for sub-neuron offsets
+class MecKinematicIntegrator
+{
+    public:
+        MecKinematicIntegrator(ConvolvedMecNetwork *network);
+        ~MecKinematicIntegrator();
+        void capture_template();
+        void advance(real velocity_x, real velocity_y);
+
+        real rate_x, rate_y;
+        double offset_x, offset_y;
+
+    protected:
+        ConvolvedMecNetwork *network;
+        Vector *template_activity;
+        int *columns;
+};
+
 class MecConvolveInput : public Input
 {
     public:
@@ -79,34 +160,174 @@ class MecConvolveInput : public Input
         MecNetwork *afferent;
 };
 
-class MecShiftedMaskInput : public Input
+// Identifies a connectivity kernel by its kind and the parameters that its
+// weights depend on
+typedef std::pair<std::string, std::vector<real>> MecKernelKey;
+
+// The tables derived from a connectivity kernel never change after they have
+// been built, and the kernels only depend on a few parameters that are the
+// same for every module. The tables are therefore shared between all inputs
+// with the same kernel through a process-wide cache, and reference counted
+// so that they are freed together with the last input that uses them. Each
+// table is built on demand by the first input whose engine needs it
+class MecKernelTables
+{
+    public:
+        static MecKernelTables *acquire(MecKernelKey key);
+        static void release(MecKernelTables *tables);
+
+        Matrix *weights = nullptr;
+        PeriodicCorrelation *periodic_correlation = nullptr;
+        bool separable_tabulated = false;
+        int separable_terms = 0;
+        Matrix *separable_weights_x = nullptr;
+        Matrix *separable_weights_y = nullptr;
+        Matrix *flipped_weights = nullptr;
+
+    protected:
+        MecKernelTables(MecKernelKey key);
+        ~MecKernelTables();
+
+        MecKernelKey key;
+        int references = 0;
+
+        static std::map<MecKernelKey, MecKernelTables *> cache;
+};
+
+class MecShiftedMaskInput : public BatchInput
 {
     public:
-        MecShiftedMaskInput(Network *efferent, NeuralSheetNetwork *afferent);
+        MecShiftedMaskInput(Network *efferent, NeuralSheetNetwork *afferent,
+            struct MecCorrelationConf correlation);
+        ~MecShiftedMaskInput();
         void initialize();
         void add_inputs();
+        void add_inputs_batch(const real *const *afferent_activities, int count,
+            real *const *destinations);
+        // The memoized contribution of the input to the efferent neurons,
+        // recalculated first if the afferent sheet has changed since. Only
+        // for inputs that memoize their contribution
+        const real *get_memoized_contribution();
+
+        // Evaluating the input is split in two: correlate() calculates the
+        // sum for every shift that some enabled efferent neuron needs into
+        // correlated_sums, indexed by shift_indices, after which the sums are
+        // gathered into the efferent neurons. Set correlated_sums_precomputed
+        // when the sums for the current step have been calculated elsewhere
+        void correlate();
+        int *shift_indices = nullptr;
+        real *correlated_sums = nullptr;
+        bool correlated_sums_precomputed = false;
+
+        // Summary of the error of the delta engine against the exact sums,
+        // as measured at each of its periodic refreshes, over all inputs
+        static void report_delta_error(std::ostream &stream);
 
     protected:
+        friend class MecRecurrentBatch;
+
         NeuralSheetNetwork *afferent;
+        struct MecCorrelationConf correlation;
+        MecKernelTables *tables = nullptr;
         Matrix *weights;
 
-        std::pair<int, int> *shifts;
-        real cached_sums[MEC_SIZE][MEC_SIZE];
-        bool cached_sum_valid[MEC_SIZE][MEC_SIZE];
+        std::pair<int, int> *shifts = nullptr;
+        bool *shift_needed = nullptr;
+
+        PeriodicCorrelation *periodic_correlation = nullptr;
+        complex_real *correlation_workspace = nullptr;
+
+        int separable_terms = 0;
+        Matrix *separable_weights_x = nullptr;
+        Matrix *separable_weights_y = nullptr;
+        real *separable_row_sums = nullptr;
+
+        Matrix *flipped_weights = nullptr;
+        int *active_sources = nullptr;
+        int distinct_shift_count;
+
+        // The delta engine keeps the sums for all shifts from one step to the
+        // next, valid for the afferent activity in delta_reference up to the
+        // changes that were below the threshold
+        real *delta_reference = nullptr;
+        int delta_steps_since_refresh;
+        bool delta_initialized = false;
+        static int delta_refresh_count;
+        static double delta_max_error;
+        static double delta_squared_error;
+        static double delta_squared_sum;
+        static std::mutex delta_error_mutex;
+
+        void initialize_separable();
+        void initialize_sparse();
+        void correlate_dense();
+        void correlate_fft();
+        void correlate_separable();
+        void correlate_sparse();
+        void correlate_delta();
+        void correlate_all_shifts(bool measure_error);
+        // Resolves the automatic engine for this input
+        virtual MecCorrelationEngine choose_engine();
+        void scatter(int source_index, real value);
+        void add_correlated_sums(real *destination);
 
+        virtual MecKernelKey get_kernel_key() = 0;
         virtual real get_weight(int x, int y) = 0;
         virtual std::pair<int, int> get_shift(int neuron_index) = 0;
+
+        // Kernels that can be written as a sum of rank-1 terms, i.e.
+        // get_weight(x, y) == sum_t get_separable_weight_x(t, x) *
+        // get_separable_weight_y(t, y), can declare so by returning the
+        // number of terms here, which allows the separable engine to
+        // evaluate them as one-dimensional row and column passes
+        virtual int get_separable_term_count() { return 0; }
+        virtual real get_separable_weight_x(int term, int x) { return 0.0; }
+        virtual real get_separable_weight_y(int term, int y) { return 0.0; }
 };
 
 class MecRecurrentInput : public MecShiftedMaskInput
 {
     public:
-        MecRecurrentInput(MecNetwork *network);
+        MecRecurrentInput(MecNetwork *network, struct MecCorrelationConf correlation);
 
     protected:
         MecNetwork *afferent;
+        MecCorrelationEngine choose_engine();
+        MecKernelKey get_kernel_key();
         real get_weight(int x, int y);
         std::pair<int, int> get_shift(int neuron_index);
+
+        int get_separable_term_count();
+        real get_separable_weight_x(int term, int x);
+        real get_separable_weight_y(int term, int y);
+};
+
+// Advances several MEC networks that share the same recurrent kernel in one
+// pass over its weights. For every shift that is needed by some enabled
+// neuron, the window of weights is read once and multiplied with all of the
+// sheets that need it, rather than once per sheet. This only applies to the
+// dense engine; with any other engine the networks correlate one by one
+class MecRecurrentBatch
+{
+    public:
+        MecRecurrentBatch(std::vector<MecNetwork *> networks);
+        // Calculates the recurrent sums of all networks, on the threads of
+        // the pool if one is given
+        void correlate(ThreadPool *pool = nullptr);
+        void update();
+        void commit();
+
+    protected:
+        std::vector<MecNetwork *> networks;
+        int sheet_size;
+        bool batched;
+
+        bool *shift_needed;
+        int *shift_sheet_counts;
+        const real **shift_sheets;
+        real **shift_outputs;
+        // The shifts needed by at least one sheet, in order
+        std::vector<int> needed_shifts;
 };
 
 class MecNetworkPlot : public Plot
@@ -7,57 +7,237 @@
 
 #include "mecdiff.h"
 
+#include <algorithm>
 #include <cstdlib>
+#include <vector>
+
+#include "main.h"
+#include "simd.h"
 
 MecDiffNetwork::MecDiffNetwork(
         bool simplified,
         NeuralSheetNetwork *current, NeuralSheetNetwork *target,
-        int direction_samples, int xy_samples, int offset)
-    : Network(direction_samples * xy_samples * xy_samples),
+        int direction_samples, int xy_samples, int offset,
+        struct MecCorrelationConf correlation, MecDiffLayout layout)
+    : Network(MecDiffNetwork::network_size(direction_samples, xy_samples, layout), false),
       simplified(simplified), current(current), target(target),
-      direction_samples(direction_samples), xy_samples(xy_samples), offset(offset)
+      direction_samples(direction_samples), xy_samples(xy_samples), offset(offset),
+      layout(layout),
+      plane_stride(round_up_to_nearest_multiple(xy_samples * xy_samples, REAL_STRIDE))
 {
+    // Draw the random initial activity of the samples in the order of the
+    // interleaved layout, so that both layouts start out the same, while
+    // listing the neurons that are samples and totalling each direction
+    this->sample_neurons = new int[this->size];
+    this->sample_count = 0;
+    this->direction_totals = new Vector(direction_samples);
+    this->next_direction_totals = new Vector(direction_samples);
+    for (int y = 0; y < xy_samples; y++) {
+        for (int x = 0; x < xy_samples; x++) {
+            for (int direction = 0; direction < direction_samples; direction++) {
+                int i = this->neuron_index(direction, x, y);
+                real activity = Network::random_initial_activity();
+                this->neurons[current_activity]->values[i] = activity;
+                this->direction_totals->values[direction] += activity;
+                this->sample_neurons[this->sample_count++] = i;
+            }
+        }
+    }
+    std::sort(this->sample_neurons, this->sample_neurons + this->sample_count);
+
     if (simplified) {
-        this->add_input(new MecDiffSimplifiedInput(this, current, 0));
-        this->add_input(new MecDiffSimplifiedInput(this, target, offset));
+        this->current_input = new MecDiffSimplifiedInput(this, current, 0);
+        this->target_input = new MecDiffSimplifiedInput(this, target, offset);
     } else {
-        this->add_input(new MecDiffCurrentInput(this, current));
-        this->add_input(new MecDiffTargetInput(this, target, offset));
+        this->current_input = new MecDiffCurrentInput(this, current, correlation);
+        this->target_input = new MecDiffTargetInput(this, target, offset, correlation);
+    }
+    this->add_input(this->current_input);
+    this->add_input(this->target_input);
+}
+
+int MecDiffNetwork::network_size(int direction_samples, int xy_samples, MecDiffLayout layout)
+{
+    if (layout == mec_diff_layout_direction_major) {
+        return direction_samples *
+            round_up_to_nearest_multiple(xy_samples * xy_samples, REAL_STRIDE);
     }
+    return direction_samples * xy_samples * xy_samples;
+}
+
+const int *MecDiffNetwork::get_enabled_neurons(int &count)
+{
+    count = this->sample_count;
+    return this->sample_neurons;
+}
+
+void MecDiffNetwork::commit()
+{
+    Network::commit();
+    Vector *previous_totals = this->direction_totals;
+    this->direction_totals = this->next_direction_totals;
+    this->next_direction_totals = previous_totals;
 }
 
 void MecDiffNetwork::update_neuron_values()
 {
-    for (int i = 0; i < this->size; i++) {
-        real input = this->neuron_inputs->values[i];
-        if (this->simplified) {
-            input -= 0.6;
+    this->rectify(this->neuron_inputs->values, nullptr,
+        this->neurons[next_activity]->values, this->next_direction_totals->values);
+}
+
+NetworkKernel MecDiffNetwork::compile_kernel()
+{
+    if (this->simplified) {
+        return Network::compile_kernel();
+    }
+    return NetworkKernel { MecDiffNetwork::fused_update_and_commit, this };
+}
+
+void MecDiffNetwork::fused_update_and_commit(void *network)
+{
+    MecDiffNetwork *mec_diff = (MecDiffNetwork *)network;
+    if (!mec_diff->current_input->is_active() || !mec_diff->target_input->is_active()) {
+        mec_diff->update_and_commit();
+        return;
+    }
+    const real *current_contribution =
+        ((MecShiftedMaskInput *)mec_diff->current_input)->get_memoized_contribution();
+    const real *target_contribution =
+        ((MecShiftedMaskInput *)mec_diff->target_input)->get_memoized_contribution();
+    mec_diff->rectify(current_contribution, target_contribution,
+        mec_diff->neurons[next_activity]->values, mec_diff->next_direction_totals->values);
+    mec_diff->MecDiffNetwork::commit();
+}
+
+// Rectifies the interleaved samples one (x, y) sample at a time, with the
+// number of directions known at compile time for the default configuration
+// (0 for any other), so that the direction of each neuron is the inner loop
+// index rather than the remainder of a division
+template<int DIRECTIONS>
+static void rectify_interleaved(const real *inputs, const real *other_inputs,
+    real *activity, real *totals, int direction_samples, int size, real bias)
+{
+    if (DIRECTIONS) {
+        direction_samples = DIRECTIONS;
+    }
+    Simd::clear(totals, direction_samples);
+    for (int first = 0; first < size; first += direction_samples) {
+        for (int direction = 0; direction < direction_samples; direction++) {
+            int i = first + direction;
+            real input = (other_inputs ? inputs[i] + other_inputs[i] : inputs[i]) + bias;
+            if (input < 0) {
+                input = 0.0;
+            }
+            activity[i] = input;
+            totals[direction] += input;
         }
-        if (input < 0) {
-            input = 0.0;
+    }
+}
+
+void MecDiffNetwork::rectify(const real *inputs, const real *other_inputs, real *activity,
+        real *totals)
+{
+    real bias = this->simplified ? -0.6 : 0.0;
+    if (this->layout == mec_diff_layout_direction_major) {
+        // Rectify and total each plane in one pass
+        int plane_size = this->xy_samples * this->xy_samples;
+        for (int direction = 0; direction < this->direction_samples; direction++) {
+            int first = direction * this->plane_stride;
+            totals[direction] = other_inputs ?
+                Simd::rectify_sum_pair(&inputs[first], &other_inputs[first],
+                    &activity[first], plane_size, bias) :
+                Simd::rectify_sum(&inputs[first], &activity[first], plane_size, bias);
         }
-        this->neurons[next_activity]->values[i] = input;
+        return;
+    }
+    if (this->direction_samples == DEFAULT_DIRECTION_SAMPLES) {
+        rectify_interleaved<DEFAULT_DIRECTION_SAMPLES>(inputs, other_inputs,
+            activity, totals, this->direction_samples, this->size, bias);
+    } else {
+        rectify_interleaved<0>(inputs, other_inputs,
+            activity, totals, this->direction_samples, this->size, bias);
+    }
+}
+
+void MecDiffNetwork::query_direction_totals(const real *const *targets, int count,
+        real *const *totals)
+{
+    // The contribution of the current sheet is shared by all targets, so it
+    // is only evaluated once, after which each target adds its own
+    const real *current_sheet = this->current->neurons[current_activity]->values;
+    std::vector<real> current_inputs(this->size, 0.0);
+    real *current_destination = current_inputs.data();
+    this->current_input->add_inputs_batch(&current_sheet, 1, &current_destination);
+    std::vector<real> inputs(count * this->size);
+    std::vector<real *> destinations(count);
+    for (int target = 0; target < count; target++) {
+        destinations[target] = &inputs[target * this->size];
+        Simd::copy(destinations[target], current_inputs.data(), this->size);
+    }
+    this->target_input->add_inputs_batch(targets, count, destinations.data());
+    std::vector<real> activity(this->size);
+    for (int target = 0; target < count; target++) {
+        this->rectify(destinations[target], nullptr, activity.data(), totals[target]);
     }
 }
 
 MecDiffCurrentInput::MecDiffCurrentInput(
-        MecDiffNetwork *efferent, NeuralSheetNetwork *afferent)
-    : MecShiftedMaskInput(efferent, afferent), efferent(efferent)
+        MecDiffNetwork *efferent, NeuralSheetNetwork *afferent,
+        struct MecCorrelationConf correlation)
+    : MecShiftedMaskInput(efferent, afferent, correlation), efferent(efferent)
 {
+    this->memoize(afferent);
+}
+
+MecKernelKey MecDiffCurrentInput::get_kernel_key()
+{
+    return MecKernelKey("mecdiff-current", {
+        (real)this->afferent->sheet_size, this->afferent->beta });
 }
 
 real MecDiffCurrentInput::get_weight(int x, int y)
 {
-    if (x > MEC_SIZE / 2) {
-        x = MEC_SIZE - x;
+    if (x > this->afferent->sheet_size / 2) {
+        x = this->afferent->sheet_size - x;
     }
-    if (y > MEC_SIZE / 2) {
-        y = MEC_SIZE - y;
+    if (y > this->afferent->sheet_size / 2) {
+        y = this->afferent->sheet_size - y;
     }
     real distance_squared = x * x + y * y;
     return 0.25 * (exp(-this->afferent->beta * distance_squared) - 1);
 }
 
+int MecDiffCurrentInput::get_separable_term_count()
+{
+    return 2;
+}
+
+real MecDiffCurrentInput::get_separable_weight_x(int term, int x)
+{
+    // 0.25 * (exp(-beta * (x^2 + y^2)) - 1) is the sum of the rank-1 terms
+    // 0.25 * exp(-beta * x^2) * exp(-beta * y^2) and -0.25 * 1 * 1
+    if (x > this->afferent->sheet_size / 2) {
+        x = this->afferent->sheet_size - x;
+    }
+    if (term == 0) {
+        return 0.25 * exp(-this->afferent->beta * x * x);
+    } else {
+        return -0.25;
+    }
+}
+
+real MecDiffCurrentInput::get_separable_weight_y(int term, int y)
+{
+    if (y > this->afferent->sheet_size / 2) {
+        y = this->afferent->sheet_size - y;
+    }
+    if (term == 0) {
+        return exp(-this->afferent->beta * y * y);
+    } else {
+        return 1.0;
+    }
+}
+
 std::pair<int, int> MecDiffCurrentInput::get_shift(int neuron_index)
 {
     return std::pair<int, int>(
@@ -66,53 +246,100 @@ std::pair<int, int> MecDiffCurrentInput::get_shift(int neuron_index)
 }
 
 MecDiffTargetInput::MecDiffTargetInput(
-        MecDiffNetwork *efferent, NeuralSheetNetwork *afferent, int offset)
-    : MecShiftedMaskInput(efferent, afferent), efferent(efferent),
+        MecDiffNetwork *efferent, NeuralSheetNetwork *afferent, int offset,
+        struct MecCorrelationConf correlation)
+    : MecShiftedMaskInput(efferent, afferent, correlation), efferent(efferent),
       offset(offset)
 {
+    // The target sheet only changes when a new goal is transferred into it
+    this->memoize(afferent);
+}
+
+MecKernelKey MecDiffTargetInput::get_kernel_key()
+{
+    return MecKernelKey("mecdiff-target", {
+        (real)this->afferent->sheet_size, this->afferent->beta });
 }
 
 real MecDiffTargetInput::get_weight(int x, int y)
 {
-    if (x > MEC_SIZE / 2) {
-        x = MEC_SIZE - x;
+    if (x > this->afferent->sheet_size / 2) {
+        x = this->afferent->sheet_size - x;
     }
-    if (y > MEC_SIZE / 2) {
-        y = MEC_SIZE - y;
+    if (y > this->afferent->sheet_size / 2) {
+        y = this->afferent->sheet_size - y;
     }
     real distance_squared = x * x + y * y;
     return exp(-this->afferent->beta * distance_squared);
 }
 
+int MecDiffTargetInput::get_separable_term_count()
+{
+    return 1;
+}
+
+real MecDiffTargetInput::get_separable_weight_x(int term, int x)
+{
+    if (x > this->afferent->sheet_size / 2) {
+        x = this->afferent->sheet_size - x;
+    }
+    return exp(-this->afferent->beta * x * x);
+}
+
+real MecDiffTargetInput::get_separable_weight_y(int term, int y)
+{
+    if (y > this->afferent->sheet_size / 2) {
+        y = this->afferent->sheet_size - y;
+    }
+    return exp(-this->afferent->beta * y * y);
+}
+
 std::pair<int, int> MecDiffTargetInput::get_shift(int neuron_index)
 {
     real direction = this->efferent->direction(neuron_index);
     int x = round(this->efferent->x(neuron_index) + this->offset * cos(direction));
     int y = round(this->efferent->y(neuron_index) + this->offset * sin(direction));
-    x = Periodic::modulo(x, MEC_SIZE);
-    y = Periodic::modulo(y, MEC_SIZE);
+    x = Periodic::modulo(x, this->afferent->sheet_size);
+    y = Periodic::modulo(y, this->afferent->sheet_size);
     return std::pair<int, int>(x, y);
 }
 
 MecDiffSimplifiedInput::MecDiffSimplifiedInput(
         MecDiffNetwork *efferent, NeuralSheetNetwork *afferent, int offset)
-    : Input(efferent), afferent(afferent)
+    : BatchInput(efferent, afferent), afferent(afferent)
 {
     this->input_indices = new int[efferent->size];
     for (int neuron_index = 0; neuron_index < efferent->size; neuron_index++) {
         real direction = efferent->direction(neuron_index);
         int x = round(efferent->x(neuron_index) + offset * cos(direction));
         int y = round(efferent->y(neuron_index) + offset * sin(direction));
-        x = Periodic::modulo(x, MEC_SIZE);
-        y = Periodic::modulo(y, MEC_SIZE);
+        x = Periodic::modulo(x, afferent->sheet_size);
+        y = Periodic::modulo(y, afferent->sheet_size);
         int input_neuron_index = afferent->coords_to_neuron_index(x, y);
         this->input_indices[neuron_index] = input_neuron_index;
     }
 }
 
+void MecDiffSimplifiedInput::add_inputs_batch(const real *const *afferent_activities, int count,
+        real *const *destinations)
+{
+    int enabled_count;
+    const int *enabled_neurons = this->efferent->get_enabled_neurons(enabled_count);
+    for (int sheet = 0; sheet < count; sheet++) {
+        for (int j = 0; j < enabled_count; j++) {
+            int neuron_index = enabled_neurons[j];
+            destinations[sheet][neuron_index] +=
+                afferent_activities[sheet][this->input_indices[neuron_index]];
+        }
+    }
+}
+
 void MecDiffSimplifiedInput::add_inputs()
 {
-    for (int neuron_index = 0; neuron_index < this->efferent->size; neuron_index++) {
+    int enabled_count;
+    const int *enabled_neurons = this->efferent->get_enabled_neurons(enabled_count);
+    for (int j = 0; j < enabled_count; j++) {
+        int neuron_index = enabled_neurons[j];
         this->efferent->neuron_inputs->values[neuron_index] +=
             this->afferent->neurons[current_activity]->values[
                 this->input_indices[neuron_index]];
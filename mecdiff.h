@@ -20,7 +20,8 @@ class MecDiffNetwork : public Network
         MecDiffNetwork(
             bool simplified,
             NeuralSheetNetwork *current, NeuralSheetNetwork *target,
-            int direction_samples, int xy_samples, int offset);
+            int direction_samples, int xy_samples, int offset,
+            struct MecCorrelationConf correlation, MecDiffLayout layout);
 
         bool simplified;
 
@@ -30,19 +31,66 @@ class MecDiffNetwork : public Network
         int xy_samples;
         int offset;
 
-        inline int direction_sample(int i) { return i % this->direction_samples; }
-        inline int x_sample(int i) { return (i / this->direction_samples) % this->xy_samples; }
-        inline int y_sample(int i) { return (i / this->direction_samples) / this->xy_samples; }
+        // In the interleaved layout, the directions of each (x, y) sample are
+        // stored next to each other. In the direction-major layout, each
+        // direction has a plane of all (x, y) samples, padded to plane_stride
+        // neurons. The padding neurons are never enabled and stay at zero,
+        // and they map to the first sample of their plane
+        MecDiffLayout layout;
+        int plane_stride;
+
+        inline int direction_sample(int i) {
+            return this->layout == mec_diff_layout_interleaved ?
+                i % this->direction_samples : i / this->plane_stride; }
+        inline int xy_sample(int i) {
+            return this->layout == mec_diff_layout_interleaved ?
+                i / this->direction_samples :
+                i % this->plane_stride < this->xy_samples * this->xy_samples ?
+                    i % this->plane_stride : 0; }
+        inline int x_sample(int i) { return this->xy_sample(i) % this->xy_samples; }
+        inline int y_sample(int i) { return this->xy_sample(i) / this->xy_samples; }
 
         inline real direction(int i) { return this->direction_sample(i) * 2 * M_PI / this->direction_samples; }
-        inline int x(int i) { return this->x_sample(i) * MEC_SIZE / this->xy_samples; }
-        inline int y(int i) { return this->y_sample(i) * MEC_SIZE / this->xy_samples; }
+        inline int x(int i) { return this->x_sample(i) * this->current->sheet_size / this->xy_samples; }
+        inline int y(int i) { return this->y_sample(i) * this->current->sheet_size / this->xy_samples; }
 
-        inline int neuron_index(int direction, int x, int y)
-            { return (y * this->xy_samples + x) * this->direction_samples + direction; }
+        inline int neuron_index(int direction, int x, int y) {
+            return this->layout == mec_diff_layout_interleaved ?
+                (y * this->xy_samples + x) * this->direction_samples + direction :
+                direction * this->plane_stride + y * this->xy_samples + x; }
+
+        const int *get_enabled_neurons(int &count);
+        void commit();
+        NetworkKernel compile_kernel();
+
+        // The totals per direction that the network would reach in one
+        // update with each of count alternative target sheets, and with the
+        // current sheet as it is, without changing the state of the network
+        void query_direction_totals(const real *const *targets, int count,
+            real *const *totals);
+
+        // The sum of the current activity over all (x, y) samples of each
+        // direction, which is calculated along with the activity itself
+        Vector *direction_totals;
 
     protected:
+        Vector *next_direction_totals;
+        int *sample_neurons;
+        int sample_count;
+        BatchInput *current_input;
+        BatchInput *target_input;
+
+        static int network_size(int direction_samples, int xy_samples, MecDiffLayout layout);
         void update_neuron_values();
+        // Rectifies the inputs, plus the other inputs if given, into the
+        // activity and its totals per direction
+        void rectify(const real *inputs, const real *other_inputs, real *activity,
+            real *totals);
+
+        // Unless simplified, both inputs memoize their contributions, which
+        // the compiled kernel rectifies straight into the next activity
+        // without going through the neuron inputs, and commits
+        static void fused_update_and_commit(void *network);
 };
 
 class MecDiffCurrentInput : public MecShiftedMaskInput
@@ -50,13 +98,19 @@ class MecDiffCurrentInput : public MecShiftedMaskInput
     public:
         MecDiffCurrentInput(
             MecDiffNetwork *efferent,
-            NeuralSheetNetwork *afferent);
+            NeuralSheetNetwork *afferent,
+            struct MecCorrelationConf correlation);
 
     protected:
         MecDiffNetwork *efferent;
 
+        MecKernelKey get_kernel_key();
         real get_weight(int x, int y);
         std::pair<int, int> get_shift(int neuron_index);
+
+        int get_separable_term_count();
+        real get_separable_weight_x(int term, int x);
+        real get_separable_weight_y(int term, int y);
 };
 
 class MecDiffTargetInput : public MecShiftedMaskInput
@@ -65,17 +119,23 @@ class MecDiffTargetInput : public MecShiftedMaskInput
         MecDiffTargetInput(
             MecDiffNetwork *efferent,
             NeuralSheetNetwork *afferent,
-            int offset);
+            int offset,
+            struct MecCorrelationConf correlation);
 
     protected:
         MecDiffNetwork *efferent;
         int offset;
 
+        MecKernelKey get_kernel_key();
         real get_weight(int x, int y);
         std::pair<int, int> get_shift(int neuron_index);
+
+        int get_separable_term_count();
+        real get_separable_weight_x(int term, int x);
+        real get_separable_weight_y(int term, int y);
 };
 
-class MecDiffSimplifiedInput : public Input
+class MecDiffSimplifiedInput : public BatchInput
 {
     public:
         MecDiffSimplifiedInput(
@@ -83,6 +143,8 @@ class MecDiffSimplifiedInput : public Input
             NeuralSheetNetwork *afferent,
             int offset);
         void add_inputs();
+        void add_inputs_batch(const real *const *afferent_activities, int count,
+            real *const *destinations);
 
     protected:
         NeuralSheetNetwork *afferent;
@@ -7,11 +7,14 @@
 
 #include "model.h"
 
+#include "cache.h"
 #include "mecdiff.h"
 #include "mec.h"
 #include "motor.h"
 #include "numerical.h"
+#include "simd.h"
 
+#include <cassert>
 #include <iostream>
 
 Model::Model(struct ModelConf conf)
@@ -22,17 +25,25 @@ Model::Model(struct ModelConf conf)
     for (int i = 0; i < this->conf.module_count; i++) {
         real current_gain = this->conf.initial_gain / pow(this->conf.gain_ratio, i);
 
-        this->mec_fixed.push_back(new MecNetwork(current_gain, this->conf.gain_mode));
-        this->mec_moving.push_back(new MecNetwork(current_gain, this->conf.gain_mode));
+        this->mec_fixed.push_back(new MecNetwork(this->conf.sheet_size, current_gain,
+            this->conf.gain_mode, this->conf.correlation, 2 * i + 1));
+        this->mec_moving.push_back(new MecNetwork(this->conf.sheet_size, current_gain,
+            this->conf.gain_mode, this->conf.correlation, 2 * i));
         this->mec_fixed_convolved.push_back(new ConvolvedMecNetwork(this->mec_fixed[i]));
         this->mec_moving_convolved.push_back(new ConvolvedMecNetwork(this->mec_moving[i]));
 
+        if (this->conf.gain_mode == gain_mode_kinematic) {
+            this->kinematic_integrators.push_back(
+                new MecKinematicIntegrator(this->mec_moving_convolved[i]));
+        }
+
         this->velocity_inputs.push_back(new VelocityInput(this->mec_moving[i]));
         this->mec_moving[i]->add_input(this->velocity_inputs[i]);
 
         this->mec_diff.push_back(new MecDiffNetwork(this->conf.simplified_mec_diff,
             this->mec_moving_convolved[i], this->mec_fixed_convolved[i],
-            this->conf.direction_samples, this->conf.xy_samples, this->conf.mec_diff_offset));
+            this->conf.direction_samples, this->conf.xy_samples, this->conf.mec_diff_offset,
+            this->conf.correlation, this->conf.mec_diff_layout));
 
         // Calculating motor scaling factors for the modules, we want the
         // factor for the largest-scaled grid module (i == conf.module_count - 1)
@@ -60,6 +71,15 @@ Model::Model(struct ModelConf conf)
             this->final_motor, this->mec_motor[i]));
     }
 
+    this->mec_moving_batch = new MecRecurrentBatch(this->mec_moving);
+    for (int i = 0; i < this->conf.module_count; i++) {
+        this->mec_moving_module_batches.push_back(
+            new MecRecurrentBatch(std::vector<MecNetwork *>(1, this->mec_moving[i])));
+    }
+    this->thread_pool = new ThreadPool(this->conf.thread_count, this->conf.pin_threads);
+    this->target_bumps.resize(this->conf.module_count);
+    this->target_bump_versions.resize(this->conf.module_count, (unsigned long)-1);
+
     this->place_graph = new PlaceGraph(this->conf.place_cell_radius);
     this->border_sensors = new Vector(this->conf.sensor_count);
 
@@ -79,26 +99,60 @@ Model::Model(struct ModelConf conf)
         new BorderMotorInput(this->first_inhibited_motor, this->border_sensors));
     this->second_border_motor_input = this->second_inhibited_motor->add_input(
         new BorderMotorInput(this->second_inhibited_motor, this->border_sensors));
+
+    // The grid sheets are updated as one stage, as they are batched across
+    // the modules and skipped while quiescent, and they may already have
+    // been updated ahead of the rest of the timestep. The fixed sheets only
+    // change when a goal is transferred into them
+    std::vector<Network *> grid_sheets;
+    for (int i = 0; i < this->conf.module_count; i++) {
+        grid_sheets.push_back(this->mec_moving[i]);
+        grid_sheets.push_back(this->mec_moving_convolved[i]);
+    }
+    this->schedule = new NetworkSchedule();
+    for (int i = 0; i < this->conf.module_count; i++) {
+        this->schedule->add_source(this->mec_fixed_convolved[i]);
+    }
+    this->schedule->add_stage(grid_sheets, [this](ThreadPool *pool) {
+        if (this->grid_modules_integrated) {
+            // Whoever ran ahead must have moved the modules by the same
+            // velocity as the input of this timestep
+            assert(this->integrated_heading == this->input.heading &&
+                this->integrated_speed == this->input.speed);
+        } else {
+            this->integrate_grid_modules(this->input.heading, this->input.speed, pool);
+        }
+        this->grid_modules_integrated = false;
+    });
+    this->grid_output = this->schedule->add_output(grid_sheets);
+    this->decoder_output = this->schedule->add_output(
+        std::vector<Network *>(1, this->final_motor));
+    this->border_output = this->schedule->add_output(
+        std::vector<Network *>(1, this->second_inhibited_motor));
+    this->schedule->compile();
 }
 
 void Model::settle()
 {
-    for (int i = 0; i < this->conf.module_count; i++) {
-        MecGainMode previous_gain_mode = this->mec_moving[i]->gain_mode;
-        this->mec_moving[i]->gain_mode = gain_mode_velocity;
-        for (int t = 0; t < SETTLE_STEPS; t++) {
-            this->mec_moving[i]->update();
-            this->mec_moving[i]->commit();
+    if (!this->load_settled_state()) {
+        this->settle_moving_sheets();
+        if (!this->conf.settle_cache.empty() && !Random::is_seeded()) {
+            // The key holds the seed, so without --seed the entry would never
+            // be looked up again
+            std::cerr << "Warning: Not saving the settled grid modules to the "
+                << "settle cache, as no --seed was given" << std::endl;
+        } else if (!this->conf.settle_cache.empty()) {
+            this->save_settled_state();
+            std::cerr << "Saved the settled grid modules to the settle cache" << std::endl;
         }
-        this->mec_moving[i]->gain_mode = previous_gain_mode;
-        this->mec_moving_convolved[i]->update();
-        this->mec_moving_convolved[i]->commit();
-        this->mec_moving_convolved[i]->initialize_bump_tracker();
+    } else {
+        std::cerr << "Loaded the settled grid modules from the settle cache" << std::endl;
     }
 
     for (int i = 0; i < this->conf.module_count; i++) {
         this->mec_fixed_convolved[i]->neurons[current_activity]->copy_from(
             this->mec_moving_convolved[i]->neurons[current_activity]);
+        this->mec_fixed_convolved[i]->activity_changed();
         this->mec_moving_convolved[i]->initialize_bump_tracker();
     }
 
@@ -106,31 +160,454 @@ void Model::settle()
     this->first_normalized_motor->override_direction = 0.0;
     this->first_normalized_motor->override_strength = 0.0;
 
-    this->first_normalized_motor->update_and_commit();
-    this->first_inhibited_motor->update_and_commit();
-    this->second_normalized_motor->update_and_commit();
-    this->second_inhibited_motor->update_and_commit();
+    this->schedule->begin_timestep();
+    this->schedule->run(this->border_output);
 }
 
-void Model::simulate_timestep()
+void Model::settle_moving_sheets()
 {
+    // The modules settle independently of each other, so let them settle
+    // on separate threads, each for as long as it needs to
+    std::vector<MecGainMode> previous_gain_modes;
     for (int i = 0; i < this->conf.module_count; i++) {
-        this->velocity_inputs[i]->set_velocity(
-            this->input.speed * std::cos(this->input.heading),
-            this->input.speed * std::sin(this->input.heading));
-        this->mec_moving[i]->update_and_commit();
-        this->mec_moving_convolved[i]->update_and_commit();
+        previous_gain_modes.push_back(this->mec_moving[i]->gain_mode);
+        this->mec_moving[i]->gain_mode = gain_mode_velocity;
+    }
+    std::vector<int> settle_steps(this->conf.module_count);
+    this->thread_pool->run(this->conf.module_count, [this, &settle_steps](int i) {
+        settle_steps[i] = this->settle_moving_sheet(i);
+    });
+    std::cerr << "Settle steps per module:";
+    for (int i = 0; i < this->conf.module_count; i++) {
+        std::cerr << " " << settle_steps[i];
+    }
+    std::cerr << std::endl;
+    for (int i = 0; i < this->conf.module_count; i++) {
+        this->mec_moving[i]->gain_mode = previous_gain_modes[i];
+        this->mec_moving_convolved[i]->update();
+        this->mec_moving_convolved[i]->commit();
+        this->mec_moving_convolved[i]->initialize_bump_tracker();
+    }
+    if (this->conf.gain_mode == gain_mode_kinematic) {
+        this->calibrate_kinematic();
+    }
+}
+
+int Model::settle_moving_sheet(int i)
+{
+    // Run the dynamics of the moving sheet of module i until it has
+    // converged, using the bump tracker of the sheet itself to follow the
+    // bump once it has formed. Returns the number of steps taken
+    MecNetwork *network = this->mec_moving[i];
+    MecRecurrentBatch *batch = this->mec_moving_module_batches[i];
+    std::pair<double, double> bump;
+    int stable_steps = 0;
+    int t = 0;
+    while (t < SETTLE_STEPS) {
+        batch->correlate();
+        network->update_fused(this->velocity_inputs[i]->get_contributions());
+        network->commit();
+        t++;
+
+        if (this->conf.settle_tolerance <= 0.0 || t < SETTLE_MIN_STEPS) {
+            continue;
+        }
+        if (t == SETTLE_MIN_STEPS) {
+            network->initialize_bump_tracker();
+            bump = network->get_bump_displacement();
+            continue;
+        }
+        network->update_bump_tracker();
+        std::pair<double, double> next_bump = network->get_bump_displacement();
+        double displacement = std::hypot(
+            next_bump.first - bump.first, next_bump.second - bump.second);
+        bump = next_bump;
+        if (network->get_max_change() <= this->conf.settle_tolerance &&
+                displacement <= SETTLE_BUMP_TOLERANCE) {
+            if (++stable_steps >= SETTLE_STABLE_STEPS) {
+                break;
+            }
+        } else {
+            stable_steps = 0;
+        }
+    }
+    return t;
+}
+
+std::vector<double> Model::settled_state_key()
+{
+    // Everything that the settled state depends on. The random seed only
+    // identifies a state together with the streams of the modules, which
+    // follow from their order, so the cache is only used with --seed
+    std::vector<double> key;
+    key.push_back(this->conf.sheet_size);
+    key.push_back(this->conf.module_count);
+    key.push_back(this->conf.gain_mode);
+    key.push_back(this->conf.correlation.engine);
+    key.push_back(this->conf.correlation.sparse_threshold);
+    key.push_back(this->conf.correlation.delta_threshold);
+    key.push_back(this->conf.correlation.delta_refresh_interval);
+    key.push_back(Random::get_seed());
+    key.push_back(this->conf.settle_tolerance);
+    key.push_back(SETTLE_STEPS);
+    key.push_back(SETTLE_MIN_STEPS);
+    key.push_back(SETTLE_STABLE_STEPS);
+    key.push_back(SETTLE_BUMP_TOLERANCE);
+    key.push_back(KINEMATIC_WARMUP_STEPS);
+    key.push_back(KINEMATIC_CALIBRATION_STEPS);
+    for (int i = 0; i < this->conf.module_count; i++) {
+        MecNetwork *network = this->mec_moving[i];
+        key.push_back(network->gain);
+        key.push_back(network->lambda);
+        key.push_back(network->beta);
+        key.push_back(network->gamma);
+    }
+    return key;
+}
+
+bool Model::load_settled_state()
+{
+    if (this->conf.settle_cache.empty() || !Random::is_seeded()) {
+        return false;
+    }
+    std::vector<int32_t> integers;
+    std::vector<real> reals;
+    SettleCache cache(this->conf.settle_cache);
+    if (!cache.load(this->settled_state_key(), integers, reals)) {
+        return false;
+    }
+    int size = this->conf.sheet_size * this->conf.sheet_size;
+    int reals_per_module = 2 * size +
+        (this->conf.gain_mode == gain_mode_kinematic ? 2 : 0);
+    if ((int)integers.size() != 4 * this->conf.module_count ||
+            (int)reals.size() != reals_per_module * this->conf.module_count) {
+        return false;
+    }
+
+    const int32_t *integer = integers.data();
+    const real *value = reals.data();
+    for (int i = 0; i < this->conf.module_count; i++) {
+        MecNetwork *moving = this->mec_moving[i];
+        ConvolvedMecNetwork *convolved = this->mec_moving_convolved[i];
+        Simd::copy(moving->neurons[current_activity]->values, value, size);
+        moving->activity_changed();
+        value += size;
+        Simd::copy(convolved->neurons[current_activity]->values, value, size);
+        convolved->activity_changed();
+        value += size;
+        // The gating step is split in two halves as the file stores int32s
+        moving->gating_step = ((uint64_t)(uint32_t)integer[0] << 32) | (uint32_t)integer[1];
+        convolved->bump_x = integer[2];
+        convolved->bump_y = integer[3];
+        convolved->bump_total_dx = 0;
+        convolved->bump_total_dy = 0;
+        convolved->bump_tracker_initialized = true;
+        integer += 4;
+        if (this->conf.gain_mode == gain_mode_kinematic) {
+            this->kinematic_integrators[i]->rate_x = value[0];
+            this->kinematic_integrators[i]->rate_y = value[1];
+            this->kinematic_integrators[i]->capture_template();
+            value += 2;
+        }
+    }
+    return true;
+}
+
+void Model::save_settled_state()
+{
+    std::vector<int32_t> integers;
+    std::vector<real> reals;
+    int size = this->conf.sheet_size * this->conf.sheet_size;
+    for (int i = 0; i < this->conf.module_count; i++) {
+        MecNetwork *moving = this->mec_moving[i];
+        ConvolvedMecNetwork *convolved = this->mec_moving_convolved[i];
+        const real *activity = moving->neurons[current_activity]->values;
+        reals.insert(reals.end(), activity, activity + size);
+        activity = convolved->neurons[current_activity]->values;
+        reals.insert(reals.end(), activity, activity + size);
+        integers.push_back((int32_t)(moving->gating_step >> 32));
+        integers.push_back((int32_t)(moving->gating_step & 0xffffffff));
+        integers.push_back(convolved->bump_x);
+        integers.push_back(convolved->bump_y);
+        if (this->conf.gain_mode == gain_mode_kinematic) {
+            reals.push_back(this->kinematic_integrators[i]->rate_x);
+            reals.push_back(this->kinematic_integrators[i]->rate_y);
+        }
+    }
+    SettleCache cache(this->conf.settle_cache);
+    cache.save(this->settled_state_key(), integers, reals);
+}
+
+void Model::update_moving_sheets()
+{
+    // Update and commit the moving sheets of all modules. This is what
+    // update_and_commit() on each of them would do, but with the recurrent
+    // sums of all modules calculated together, and with the recurrent and
+    // velocity inputs fused into the update of each sheet
+    this->mec_moving_batch->correlate();
+    for (int i = 0; i < this->conf.module_count; i++) {
+        if (this->mec_moving[i]->quiescent) {
+            continue;
+        }
+        this->mec_moving[i]->update_fused(this->velocity_inputs[i]->get_contributions());
+        this->mec_moving[i]->commit();
+    }
+}
+
+void Model::update_moving_module(int i)
+{
+    // What update_moving_sheets(), update_moving_convolved_sheets() and
+    // update_quiescence() do for one module once the recurrent sums have
+    // been calculated, touching nothing of the other modules
+    if (!this->mec_moving[i]->quiescent) {
+        this->mec_moving[i]->update_fused(this->velocity_inputs[i]->get_contributions());
+        this->mec_moving[i]->commit();
+        this->mec_moving_convolved[i]->update_fused();
+        this->mec_moving_convolved[i]->commit();
+        this->mec_moving_convolved[i]->update_bump_tracker();
+    }
+    this->update_quiescence(i);
+}
+
+void Model::update_quiescence(int i)
+{
+    // While the agent is at rest, the sheets only relax towards the state
+    // they have already settled in. Once no neuron of a sheet changes by
+    // more than the tolerance, the sheet (and its convolved sheet and bump
+    // tracker) is left alone until the agent starts moving again. As the
+    // sheet has just been committed, its next activity holds the previous one
+    if (this->conf.quiescence_tolerance > 0.0 && !this->mec_moving[i]->quiescent &&
+            this->velocity_inputs[i]->velocity_x == 0.0 &&
+            this->velocity_inputs[i]->velocity_y == 0.0 &&
+            this->mec_moving[i]->get_max_change() <= this->conf.quiescence_tolerance) {
+        this->mec_moving[i]->quiescent = true;
+    }
+}
+
+void Model::update_moving_convolved_sheets()
+{
+    for (int i = 0; i < this->conf.module_count; i++) {
+        if (this->mec_moving[i]->quiescent) {
+            continue;
+        }
+        this->mec_moving_convolved[i]->update_fused();
+        this->mec_moving_convolved[i]->commit();
         this->mec_moving_convolved[i]->update_bump_tracker();
     }
+}
+
+void Model::calibrate_kinematic()
+{
+    // Measure how far the bumps move per step and unit of speed along each
+    // axis, by running the actual dynamics for a while in that direction.
+    // The bump velocity is proportional to the gain, and the bumps move in
+    // small jumps between the neurons, so the measurements of all modules
+    // are pooled into one velocity per unit of gain, which is less noisy
+    // than measuring each module by itself, in particular the slowest ones
+    real total_gain = 0.0;
+    for (int i = 0; i < this->conf.module_count; i++) {
+        this->mec_moving[i]->gain_mode = gain_mode_poisson_neuron;
+        total_gain += this->mec_moving[i]->gain;
+    }
+    for (int axis = 0; axis < 2; axis++) {
+        for (int i = 0; i < this->conf.module_count; i++) {
+            this->velocity_inputs[i]->set_velocity(
+                axis == 0 ? FIXED_SPEED : 0.0, axis == 1 ? FIXED_SPEED : 0.0);
+        }
+        for (int t = 0; t < KINEMATIC_WARMUP_STEPS; t++) {
+            this->update_moving_sheets();
+            this->update_moving_convolved_sheets();
+        }
+        std::vector<std::pair<double, double>> start;
+        for (int i = 0; i < this->conf.module_count; i++) {
+            start.push_back(this->mec_moving_convolved[i]->get_bump_displacement());
+        }
+        for (int t = 0; t < KINEMATIC_CALIBRATION_STEPS; t++) {
+            this->update_moving_sheets();
+            this->update_moving_convolved_sheets();
+        }
+        double total_displacement = 0.0;
+        for (int i = 0; i < this->conf.module_count; i++) {
+            std::pair<double, double> end =
+                this->mec_moving_convolved[i]->get_bump_displacement();
+            total_displacement += (axis == 0 ?
+                end.first - start[i].first : end.second - start[i].second);
+        }
+        real rate_per_gain = total_displacement /
+            (KINEMATIC_CALIBRATION_STEPS * FIXED_SPEED * total_gain);
+        for (int i = 0; i < this->conf.module_count; i++) {
+            real rate = rate_per_gain * this->mec_moving[i]->gain;
+            if (axis == 0) {
+                this->kinematic_integrators[i]->rate_x = rate;
+            } else {
+                this->kinematic_integrators[i]->rate_y = rate;
+            }
+        }
+    }
+
+    // Let the bumps come to rest before capturing them as the templates
+    for (int i = 0; i < this->conf.module_count; i++) {
+        this->velocity_inputs[i]->set_velocity(0.0, 0.0);
+    }
+    for (int t = 0; t < KINEMATIC_WARMUP_STEPS; t++) {
+        this->update_moving_sheets();
+        this->update_moving_convolved_sheets();
+    }
+    for (int i = 0; i < this->conf.module_count; i++) {
+        this->mec_moving[i]->gain_mode = gain_mode_kinematic;
+        this->kinematic_integrators[i]->capture_template();
+    }
+}
+
+void Model::decode_analytic(double &direction, double &strength)
+{
+    // The MEC diff neurons of a module respond to the direction from the
+    // bump of its moving sheet to the nearest bump of its target sheet, more
+    // weakly when the two are closer than the offset of the target input.
+    // Work that out from the tracked bumps directly, and add up the modules
+    // with the same scaling factors as their motor networks
+    int sheet_size = this->conf.sheet_size;
+    double x = 0.0, y = 0.0;
+    for (int i = 0; i < this->conf.module_count; i++) {
+        ConvolvedMecNetwork *target = this->mec_fixed_convolved[i];
+        if (this->target_bump_versions[i] != target->activity_version) {
+            target->find_bump_centers(this->target_bumps[i]);
+            this->target_bump_versions[i] = target->activity_version;
+        }
+        std::pair<double, double> from = this->mec_moving_convolved[i]->get_bump_position();
+        double best_dx = 0.0, best_dy = 0.0, best_distance = -1.0;
+        for (std::pair<double, double> &to : this->target_bumps[i]) {
+            double dx = Periodic::double_modulo(
+                to.first - from.first + 0.5 * sheet_size, sheet_size) - 0.5 * sheet_size;
+            double dy = Periodic::double_modulo(
+                to.second - from.second + 0.5 * sheet_size, sheet_size) - 0.5 * sheet_size;
+            double distance = std::hypot(dx, dy);
+            if (best_distance < 0.0 || distance < best_distance) {
+                best_dx = dx;
+                best_dy = dy;
+                best_distance = distance;
+            }
+        }
+        if (best_distance <= 0.0) {
+            continue;
+        }
+        double weight = this->mec_motor[i]->scaling_factor *
+            MIN(best_distance / this->conf.mec_diff_offset, 1.0) / best_distance;
+        x += weight * best_dx;
+        y += weight * best_dy;
+    }
+    direction = std::atan2(y, x);
+    strength = std::hypot(x, y);
+}
+
+void Model::report_decoder_error(std::ostream &stream)
+{
+    stream << "Analytic decoder error over " << this->decoder_comparisons
+        << " steps: mean " << (this->decoder_comparisons > 0 ?
+            this->decoder_error_sum / this->decoder_comparisons * 180.0 / M_PI : 0.0)
+        << " degrees, max " << this->decoder_error_max * 180.0 / M_PI << " degrees" << std::endl;
+}
+
+void Model::query_decoder(const std::vector<PlaceCell *> &candidates,
+        std::vector<std::pair<double, double>> &results)
+{
+    // Find the direction and strength that the neural decoder would arrive
+    // at if the grid state of each candidate were transferred to it, without
+    // touching the target sheets or the decoder networks. Each module reads
+    // its moving sheet once for all candidates
+    int count = candidates.size();
+    int direction_samples = this->conf.direction_samples;
+    int sheet_neurons = this->conf.sheet_size * this->conf.sheet_size;
+    std::vector<real> targets(count * sheet_neurons);
+    std::vector<real> totals(count * direction_samples);
+    std::vector<real> final_inputs(count * direction_samples, 0.0);
+    std::vector<const real *> target_pointers(count);
+    std::vector<real *> total_pointers(count);
+    for (int c = 0; c < count; c++) {
+        target_pointers[c] = &targets[c * sheet_neurons];
+        total_pointers[c] = &totals[c * direction_samples];
+    }
+    for (int i = 0; i < this->conf.module_count; i++) {
+        for (int c = 0; c < count; c++) {
+            candidates[c]->grid_state[i]->load(&targets[c * sheet_neurons]);
+        }
+        this->mec_diff[i]->query_direction_totals(
+            target_pointers.data(), count, total_pointers.data());
+        real scaling_factor = this->mec_motor[i]->scaling_factor;
+        for (int j = 0; j < count * direction_samples; j++) {
+            final_inputs[j] += MAX(totals[j], 0.0) * scaling_factor;
+        }
+    }
+    results.resize(count);
+    for (int c = 0; c < count; c++) {
+        real *inputs = &final_inputs[c * direction_samples];
+        for (int direction = 0; direction < direction_samples; direction++) {
+            inputs[direction] = MAX(inputs[direction], 0.0);
+        }
+        double direction, strength;
+        std::tie(direction, strength) =
+            this->final_motor->calculate_direction_and_strength(inputs);
+        results[c] = std::make_pair(direction, strength);
+    }
+}
+
+void Model::integrate_grid_modules(double heading, double speed, ThreadPool *pool)
+{
+    for (int i = 0; i < this->conf.module_count; i++) {
+        this->velocity_inputs[i]->set_velocity(
+            speed * std::cos(heading), speed * std::sin(heading));
+        if (speed != 0.0) {
+            this->mec_moving[i]->quiescent = false;
+        }
+    }
+    if (this->conf.gain_mode == gain_mode_kinematic) {
+        // Shift the templates instead of running the attractor dynamics,
+        // which leaves the sheets as they are while the agent is at rest
+        if (speed != 0.0) {
+            ThreadPool::run_on(pool, this->conf.module_count, [this](int i) {
+                this->kinematic_integrators[i]->advance(
+                    this->velocity_inputs[i]->velocity_x, this->velocity_inputs[i]->velocity_y);
+                this->mec_moving_convolved[i]->update_bump_tracker();
+            });
+        }
+    } else {
+        // The recurrent sums of all modules are calculated together, split
+        // over the threads by shift, after which each module steps on its own
+        this->mec_moving_batch->correlate(pool);
+        ThreadPool::run_on(pool, this->conf.module_count, [this](int i) {
+            this->update_moving_module(i);
+        });
+    }
+    this->grid_modules_integrated = true;
+    this->integrated_heading = heading;
+    this->integrated_speed = speed;
+}
+
+void Model::simulate_timestep()
+{
+    this->schedule->begin_timestep();
+    this->schedule->run(this->grid_output, this->thread_pool);
 
     this->place_graph->update(this);
 
     if (this->input.motor_mode == grid_decoder_mode) {
-        for (int i = 0; i < this->conf.module_count; i++) {
-            this->mec_diff[i]->update_and_commit();
-            this->mec_motor[i]->update_and_commit();
+        if (this->conf.decoder == decoder_analytic) {
+            this->decode_analytic(this->final_motor->direction, this->final_motor->strength);
+        } else {
+            this->schedule->run(this->decoder_output, this->thread_pool);
+        }
+        if (this->conf.decoder == decoder_validate) {
+            double direction, strength;
+            this->decode_analytic(direction, strength);
+            if (strength > 0.0 && this->final_motor->strength > 0.0) {
+                double error = std::abs(std::atan2(
+                    std::sin(direction - this->final_motor->direction),
+                    std::cos(direction - this->final_motor->direction)));
+                this->decoder_comparisons++;
+                this->decoder_error_sum += error;
+                this->decoder_error_max = MAX(this->decoder_error_max, error);
+            }
         }
-        this->final_motor->update_and_commit();
     }
 
     this->output.halted = true;
@@ -160,10 +637,7 @@ void Model::simulate_timestep()
         this->first_normalized_motor->normalization_spread = this->input.motor_tuning;
         this->second_normalized_motor->normalization_spread = this->conf.internal_motor_tuning;
 
-        this->first_normalized_motor->update_and_commit();
-        this->first_inhibited_motor->update_and_commit();
-        this->second_normalized_motor->update_and_commit();
-        this->second_inhibited_motor->update_and_commit();
+        this->schedule->run(this->border_output);
 
         if (this->first_normalized_motor->strength > 0.0 &&
                 this->second_normalized_motor->strength > 0.0) {
@@ -186,8 +660,23 @@ void Model::simulate_timestep()
 }
 
 VelocityInput::VelocityInput(MecNetwork *efferent)
-    : Input(efferent), efferent(efferent), velocity_x(0.0), velocity_y(0.0)
+    : Input(efferent), efferent(efferent), velocity_x(0.0), velocity_y(0.0),
+      contributions_valid(false)
 {
+    this->direction_x = new Vector(efferent->size);
+    this->direction_y = new Vector(efferent->size);
+    this->contributions = new Vector(efferent->size);
+    for (int y = 0; y < efferent->sheet_size; y++) {
+        for (int x = 0; x < efferent->sheet_size; x++) {
+            int neuron_index = efferent->coords_to_neuron_index(x, y);
+            switch (efferent->directionality(x, y)) {
+            case north: this->direction_y->values[neuron_index] = 1.0; break;
+            case south: this->direction_y->values[neuron_index] = -1.0; break;
+            case east: this->direction_x->values[neuron_index] = 1.0; break;
+            case west: this->direction_x->values[neuron_index] = -1.0; break;
+            }
+        }
+    }
 }
 
 void VelocityInput::set_velocity(real x, real y)
@@ -196,28 +685,44 @@ void VelocityInput::set_velocity(real x, real y)
     this->velocity_y = y;
 }
 
-void VelocityInput::add_inputs()
+const real *VelocityInput::get_contributions()
 {
-    for (int y = 0; y < MEC_SIZE; y++) {
-        for (int x = 0; x < MEC_SIZE; x++) {
-            real contribution = 0.0;
-            switch (this->efferent->directionality(x, y)) {
-            case north: contribution = this->velocity_y; break;
-            case south: contribution = -this->velocity_y; break;
-            case east: contribution = this->velocity_x; break;
-            case west: contribution = -this->velocity_x; break;
-            }
-            if (this->efferent->gain_mode == gain_mode_velocity) {
-                contribution *= this->efferent->gain;
-            } else {
-                contribution *= MAX_MEC_GAIN;
-            }
+    if (!this->contributions_valid ||
+            this->contributions_velocity_x != this->velocity_x ||
+            this->contributions_velocity_y != this->velocity_y ||
+            this->contributions_gain_mode != this->efferent->gain_mode) {
+        real gain;
+        if (this->efferent->gain_mode == gain_mode_poisson_neuron) {
+            gain = MAX_MEC_GAIN;
+        } else {
+            gain = this->efferent->gain;
+        }
+        // Only one of the masks is nonzero for each neuron, so this gives
+        // exactly the signed velocity component in its preferred direction.
+        // (The loop goes through plain pointers, since the compiler would
+        // otherwise take every element of an aligned_real array to be aligned)
+        const real *direction_x = this->direction_x->values;
+        const real *direction_y = this->direction_y->values;
+        real *contributions = this->contributions->values;
+        for (int i = 0; i < this->efferent->size; i++) {
+            real contribution =
+                direction_x[i] * this->velocity_x + direction_y[i] * this->velocity_y;
+            contribution *= gain;
             contribution *= 0.10315;
-
-            int neuron_index = this->efferent->coords_to_neuron_index(x, y);
-            this->efferent->neuron_inputs->values[neuron_index] += contribution;
+            contributions[i] = contribution;
         }
+        this->contributions_valid = true;
+        this->contributions_velocity_x = this->velocity_x;
+        this->contributions_velocity_y = this->velocity_y;
+        this->contributions_gain_mode = this->efferent->gain_mode;
     }
+    return this->contributions->values;
+}
+
+void VelocityInput::add_inputs()
+{
+    const real *contributions = this->get_contributions();
+    Simd::axpy(this->efferent->neuron_inputs->values, contributions, 1.0, this->efferent->size);
 }
 
 AllMotorsPlot::AllMotorsPlot(Model *model)
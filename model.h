@@ -8,6 +8,7 @@
 #ifndef MODEL_H_INCLUDED
 #define MODEL_H_INCLUDED
 
+#include <ostream>
 #include <vector>
 #include <utility>
 
@@ -18,6 +19,8 @@
 #include "plot.h"
 #include "graph.h"
 #include "motor.h"
+#include "parallel.h"
+#include "schedule.h"
 
 class MecDiffNetwork;
 class MotorNetwork;
@@ -32,7 +35,29 @@ class Model
         Model(struct ModelConf conf);
 
         void settle();
+        void settle_moving_sheets();
+        int settle_moving_sheet(int i);
+        bool load_settled_state();
+        void save_settled_state();
+        std::vector<double> settled_state_key();
         void simulate_timestep();
+        // Moves the grid modules by the given velocity, which is the first
+        // part of simulate_timestep(). Calling it ahead of simulate_timestep()
+        // with the velocity that the input will have lets other work of the
+        // timestep run alongside. The modules are updated in parallel on the
+        // pool, if given
+        void integrate_grid_modules(double heading, double speed, ThreadPool *pool);
+        bool grid_modules_integrated = false;
+        double integrated_heading, integrated_speed;
+        void update_moving_sheets();
+        void update_moving_convolved_sheets();
+        void update_moving_module(int i);
+        void update_quiescence(int i);
+        void calibrate_kinematic();
+        void decode_analytic(double &direction, double &strength);
+        void report_decoder_error(std::ostream &stream);
+        void query_decoder(const std::vector<PlaceCell *> &candidates,
+            std::vector<std::pair<double, double>> &results);
 
         struct ModelConf conf;
 
@@ -57,8 +82,13 @@ class Model
         std::vector<VelocityInput *> velocity_inputs;
         std::vector<MecNetwork *> mec_fixed;
         std::vector<MecNetwork *> mec_moving;
+        MecRecurrentBatch *mec_moving_batch;
+        // Batches of one module each, for settling the modules separately
+        std::vector<MecRecurrentBatch *> mec_moving_module_batches;
+        ThreadPool *thread_pool;
         std::vector<ConvolvedMecNetwork *> mec_fixed_convolved;
         std::vector<ConvolvedMecNetwork *> mec_moving_convolved;
+        std::vector<MecKinematicIntegrator *> kinematic_integrators;
         std::vector<MecDiffNetwork *> mec_diff;
         std::vector<MotorNetwork *> mec_motor;
         MotorNetwork *final_motor;
@@ -71,7 +101,27 @@ class Model
         Input *first_border_motor_input;
         Input *second_border_motor_input;
 
+        // The networks of each timestep. The grid sheets are one stage of
+        // the schedule, which is needed by the rest of the timestep, while
+        // the decoder networks that lead up to the final motor network and
+        // the chain of border motor networks are only needed in some modes
+        NetworkSchedule *schedule;
+        int grid_output;
+        int decoder_output;
+        int border_output;
+
         double confidence;
+
+    protected:
+        // The bumps of the target sheet of each module, found again whenever
+        // the version of its activity changes
+        std::vector<std::vector<std::pair<double, double>>> target_bumps;
+        std::vector<unsigned long> target_bump_versions;
+
+        // Angle between the neural and the analytic decoder, in validation
+        int decoder_comparisons = 0;
+        double decoder_error_sum = 0.0;
+        double decoder_error_max = 0.0;
 };
 
 class VelocityInput : public Input
@@ -80,11 +130,25 @@ class VelocityInput : public Input
         VelocityInput(MecNetwork *efferent);
         void add_inputs();
         void set_velocity(real x, real y);
+        const real *get_contributions();
 
         MecNetwork *efferent;
 
         real velocity_x;
         real velocity_y;
+
+    protected:
+        // The directional preference of each neuron as a pair of masks with
+        // the values -1, 0 and 1, and the resulting contribution of the
+        // current velocity to each neuron. The contributions only need to be
+        // recalculated when the velocity or the gain mode changes
+        Vector *direction_x;
+        Vector *direction_y;
+        Vector *contributions;
+        bool contributions_valid;
+        real contributions_velocity_x;
+        real contributions_velocity_y;
+        MecGainMode contributions_gain_mode;
 };
 
 class AllMotorsPlot : public Plot
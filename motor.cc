@@ -10,12 +10,20 @@
 #include <cassert>
 #include <cmath>
 
+#include "main.h"
 #include "mecdiff.h"
+#include "simd.h"
 
 MotorNetwork::MotorNetwork(int direction_samples, double scaling_factor, bool normalize)
     : Network(direction_samples), direction_samples(direction_samples),
       scaling_factor(scaling_factor), normalize(normalize)
 {
+    for (int i = 0; i < direction_samples; i++) {
+        double angle = i * 2 * M_PI / direction_samples;
+        this->direction_cosines.push_back(std::cos(angle));
+        this->direction_sines.push_back(std::sin(angle));
+    }
+
     // Flip current_activity and next_activity. current_activity starts with
     // random initial conditions, whereas next_activity is zeroed. We want the
     // latter for the motor neurons.
@@ -31,58 +39,164 @@ void MotorNetwork::commit()
 
 std::tuple<double, double> MotorNetwork::calculate_direction_and_strength(NeuronActivity activity)
 {
+    return this->calculate_direction_and_strength(this->neurons[activity]->values);
+}
+
+// The loops over the directions are templates on the number of directions,
+// and are instantiated for the counts of the default configuration (the grid
+// decoder and the border sensors) so that their bounds are known at compile
+// time. A count of 0 gives the generic instantiation, used for any other count
+#define DIRECTION_COUNT_DISPATCH(count, function, ...) \
+    switch (count) { \
+    case DEFAULT_DIRECTION_SAMPLES: return function<DEFAULT_DIRECTION_SAMPLES>(__VA_ARGS__); \
+    case DEFAULT_SENSOR_COUNT: return function<DEFAULT_SENSOR_COUNT>(__VA_ARGS__); \
+    default: return function<0>(__VA_ARGS__); \
+    }
+
+template<int DIRECTIONS>
+static std::tuple<double, double> population_vector(const real *values,
+    const double *cosines, const double *sines, int direction_samples)
+{
+    if (DIRECTIONS) {
+        direction_samples = DIRECTIONS;
+    }
     double x = 0.0, y = 0.0;
-    for (int i = 0; i < this->direction_samples; i++) {
-        double value = this->neurons[activity]->values[i];
-        double angle = i * 2 * M_PI / direction_samples;
-        x += value * std::cos(angle);
-        y += value * std::sin(angle);
+    for (int i = 0; i < direction_samples; i++) {
+        double value = values[i];
+        x += value * cosines[i];
+        y += value * sines[i];
     }
     return std::make_tuple(
         std::atan2(y, x),
         std::sqrt(std::pow(x, 2) + std::pow(y, 2)));
+}
 
+// Replaces the values with a bump centered on the given direction, scaled so
+// that its peak is at the given height, or with zeros if strength is zero
+template<int DIRECTIONS>
+static void normalize_directions(real *values, const double *cosines, const double *sines,
+    int direction_samples, double direction, double strength, double spread, double peak)
+{
+    if (DIRECTIONS) {
+        direction_samples = DIRECTIONS;
+    }
+    double direction_cosine = std::cos(direction);
+    double direction_sine = std::sin(direction);
+    double peak_activation = 0.0;
+    for (int i = 0; i < direction_samples; i++) {
+        // Rotating the preferred direction of the neuron backwards by the
+        // given direction leaves the difference between the two
+        double direction_difference = std::atan2(
+            sines[i] * direction_cosine - cosines[i] * direction_sine,
+            cosines[i] * direction_cosine + sines[i] * direction_sine);
+        values[i] = strength * std::exp(
+            -pow(direction_difference, 2) / (2 * pow(spread, 2)));
+        peak_activation = MAX(peak_activation, values[i]);
+    }
+    double rescaling = peak_activation > 0.0 ? peak / peak_activation : 0.0;
+    for (int i = 0; i < direction_samples; i++) {
+        values[i] *= rescaling;
+    }
+}
+
+// Sets the values to the sum of the active terms, in the order of the inputs
+template<int DIRECTIONS>
+static void accumulate_terms(real *values, const MotorKernelTerm *terms, int term_count,
+    int direction_samples)
+{
+    if (DIRECTIONS) {
+        direction_samples = DIRECTIONS;
+    }
+    for (int i = 0; i < direction_samples; i++) {
+        values[i] = 0.0;
+    }
+    for (int term = 0; term < term_count; term++) {
+        if (!terms[term].input->is_active()) {
+            continue;
+        }
+        const real *source = (*terms[term].source)->values;
+        double scale = terms[term].scale;
+        for (int i = 0; i < direction_samples; i++) {
+            values[i] += source[i] * scale;
+        }
+    }
+}
+
+std::tuple<double, double> MotorNetwork::calculate_direction_and_strength(const real *values)
+{
+    DIRECTION_COUNT_DISPATCH(this->direction_samples, population_vector,
+        values, this->direction_cosines.data(), this->direction_sines.data(),
+        this->direction_samples);
 }
 
 void MotorNetwork::update_neuron_values()
+{
+    real *values = this->neurons[next_activity]->values;
+    Simd::copy(values, this->neuron_inputs->values, this->direction_samples);
+    this->rectify_and_normalize(values);
+}
+
+void MotorNetwork::rectify_and_normalize(real *values)
 {
     for (int i = 0; i < this->direction_samples; i++) {
-        this->neurons[next_activity]->values[i] = this->neuron_inputs->values[i];
-        if (this->neurons[next_activity]->values[i] < 0.0) {
-            this->neurons[next_activity]->values[i] = 0.0;
+        if (values[i] < 0.0) {
+            values[i] = 0.0;
         }
     }
     if (this->normalize) {
         double final_direction, final_strength;
         std::tie(final_direction, final_strength) =
-            this->calculate_direction_and_strength(next_activity);
+            this->calculate_direction_and_strength(values);
         if (this->override_active) {
             final_direction = this->override_direction;
             final_strength = this->override_strength;
         }
         final_strength = (final_strength > 0.0 ? 1.0 : 0.0);
+        this->normalize_activity(values, final_direction, final_strength);
+    }
+}
 
-        double peak_activation = 0.0;
-        for (int i = 0; i < this->direction_samples; i++) {
-            double direction = i * 2 * M_PI / direction_samples;
-            double direction_difference = std::atan2(
-                std::sin(direction - final_direction),
-                std::cos(direction - final_direction));
-            this->neurons[next_activity]->values[i] = final_strength * std::exp(
-                -pow(direction_difference, 2) / (2 * pow(this->normalization_spread, 2)));
-            peak_activation = MAX(peak_activation,
-                this->neurons[next_activity]->values[i]);
-        }
-        double rescaling = peak_activation > 0.0 ? this->normalization_peak / peak_activation : 0.0;
-        for (int i = 0; i < this->direction_samples; i++) {
-            this->neurons[next_activity]->values[i] *= rescaling;
+NetworkKernel MotorNetwork::compile_kernel()
+{
+    this->kernel_terms.clear();
+    for (Input *input : *this->inputs) {
+        MotorKernelTerm term;
+        term.input = input;
+        if (!input->get_linear_source(term.source, term.scale)) {
+            return Network::compile_kernel();
         }
+        this->kernel_terms.push_back(term);
     }
+    return NetworkKernel { MotorNetwork::fused_update_and_commit, this };
+}
+
+void MotorNetwork::fused_update_and_commit(void *network)
+{
+    MotorNetwork *motor_network = (MotorNetwork *)network;
+    real *values = motor_network->neurons[next_activity]->values;
+    motor_network->accumulate_kernel_terms(values);
+    motor_network->rectify_and_normalize(values);
+    motor_network->MotorNetwork::commit();
+}
+
+void MotorNetwork::accumulate_kernel_terms(real *values)
+{
+    DIRECTION_COUNT_DISPATCH(this->direction_samples, accumulate_terms,
+        values, this->kernel_terms.data(), this->kernel_terms.size(),
+        this->direction_samples);
+}
+
+void MotorNetwork::normalize_activity(real *values, double direction, double strength)
+{
+    DIRECTION_COUNT_DISPATCH(this->direction_samples, normalize_directions,
+        values, this->direction_cosines.data(), this->direction_sines.data(),
+        this->direction_samples, direction, strength,
+        this->normalization_spread, this->normalization_peak);
 }
 
 MecDiffMotorInput::MecDiffMotorInput(
         MotorNetwork *motor_network, MecDiffNetwork *mec_diff_network)
-    : Input(motor_network), motor_network(motor_network),
+    : Input(motor_network, mec_diff_network), motor_network(motor_network),
       mec_diff_network(mec_diff_network)
 {
     assert(motor_network->direction_samples == mec_diff_network->direction_samples);
@@ -90,20 +204,22 @@ MecDiffMotorInput::MecDiffMotorInput(
 
 void MecDiffMotorInput::add_inputs()
 {
-    for (int y = 0; y < this->mec_diff_network->xy_samples; y++) {
-        for (int x = 0; x < this->mec_diff_network->xy_samples; x++) {
-            for (int direction = 0; direction < this->mec_diff_network->direction_samples; direction++) {
-                int index = this->mec_diff_network->neuron_index(direction, x, y);
-                auto value = this->mec_diff_network->neurons[current_activity]->values[index];
-                this->motor_network->neuron_inputs->values[direction] += value;
-            }
-        }
-    }
+    // The MEC diff network totals its activity per direction as it updates
+    Simd::axpy(this->motor_network->neuron_inputs->values,
+        this->mec_diff_network->direction_totals->values, 1.0,
+        this->mec_diff_network->direction_samples);
+}
+
+bool MecDiffMotorInput::get_linear_source(Vector **&source, double &scale)
+{
+    source = &this->mec_diff_network->direction_totals;
+    scale = 1.0;
+    return true;
 }
 
 MotorMotorInput::MotorMotorInput(
         MotorNetwork *efferent, MotorNetwork *afferent)
-    : Input(efferent), efferent(efferent), afferent(afferent)
+    : Input(efferent, afferent), efferent(efferent), afferent(afferent)
 {
     assert(efferent->direction_samples == afferent->direction_samples);
 }
@@ -116,6 +232,13 @@ void MotorMotorInput::add_inputs()
     }
 }
 
+bool MotorMotorInput::get_linear_source(Vector **&source, double &scale)
+{
+    source = &this->afferent->neurons[current_activity];
+    scale = this->afferent->scaling_factor;
+    return true;
+}
+
 BorderMotorInput::BorderMotorInput(MotorNetwork *efferent, Vector *border_sensors)
     : Input(efferent), efferent(efferent), border_sensors(border_sensors)
 {
@@ -128,6 +251,13 @@ void BorderMotorInput::add_inputs()
     }
 }
 
+bool BorderMotorInput::get_linear_source(Vector **&source, double &scale)
+{
+    source = &this->border_sensors;
+    scale = -1.0;
+    return true;
+}
+
 MotorNetworkPlot::MotorNetworkPlot(MotorNetwork *network,
         const char *color, const char *title, bool simplified, double plot_range)
     : network(network), color(color), simplified(simplified), plot_range(plot_range)
@@ -9,6 +9,7 @@
 #define MOTOR_H_INCLUDED
 
 #include <tuple>
+#include <vector>
 
 #include "network.h"
 #include "numerical.h"
@@ -18,11 +19,19 @@ class MecDiffNetwork;
 class MecDiffMotorInput;
 class MotorMotorInput;
 
+// An input accumulated by the compiled kernel of a motor network
+struct MotorKernelTerm {
+    Input *input;
+    Vector **source;
+    double scale;
+};
+
 class MotorNetwork : public Network
 {
     public:
         MotorNetwork(int direction_samples, double scaling_factor, bool normalize);
         void commit();
+        NetworkKernel compile_kernel();
 
         int direction_samples;
         double scaling_factor;
@@ -39,9 +48,25 @@ class MotorNetwork : public Network
         double direction = 0.0;
         double strength = 0.0;
 
+        // The population vector of a set of direction values
+        std::tuple<double, double> calculate_direction_and_strength(const real *values);
+
     protected:
+        // The cosine and sine of the preferred direction of each neuron
+        std::vector<double> direction_cosines;
+        std::vector<double> direction_sines;
+
         void update_neuron_values();
+        void rectify_and_normalize(real *values);
+        void normalize_activity(real *values, double direction, double strength);
         std::tuple<double, double> calculate_direction_and_strength(NeuronActivity activity);
+
+        // The compiled kernel sums the inputs straight into the next
+        // activity, when all of them are linear, and commits it in the same
+        // call
+        std::vector<MotorKernelTerm> kernel_terms;
+        static void fused_update_and_commit(void *network);
+        void accumulate_kernel_terms(real *values);
 };
 
 class MecDiffMotorInput : public Input
@@ -51,6 +76,7 @@ class MecDiffMotorInput : public Input
             MotorNetwork *motor_network,
             MecDiffNetwork *mec_diff_network);
         void add_inputs();
+        bool get_linear_source(Vector **&source, double &scale);
 
         MotorNetwork *motor_network;
         MecDiffNetwork *mec_diff_network;
@@ -63,6 +89,7 @@ class MotorMotorInput : public Input
             MotorNetwork *efferent,
             MotorNetwork *afferent);
         void add_inputs();
+        bool get_linear_source(Vector **&source, double &scale);
 
         MotorNetwork *efferent;
         MotorNetwork *afferent;
@@ -73,6 +100,7 @@ class BorderMotorInput : public Input
     public:
         BorderMotorInput(MotorNetwork *efferent, Vector *border_sensors);
         void add_inputs();
+        bool get_linear_source(Vector **&source, double &scale);
 
         MotorNetwork *efferent;
         Vector *border_sensors;
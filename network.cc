@@ -8,20 +8,26 @@
 #include "network.h"
 
 #include "numerical.h"
+#include "simd.h"
 
-Network::Network(int size)
+Network::Network(int size, bool random_activity)
     : size(size)
 {
     for (int i = 0; i < NEURON_ACTIVITY_COUNT; i++) {
         this->neurons[i] = new Vector(this->size);
     }
-    for (int i = 0; i < this->size; i++) {
-        this->neurons[current_activity]->values[i] = Random::uniform() * 0.0001;
+    for (int i = 0; random_activity && i < this->size; i++) {
+        this->neurons[current_activity]->values[i] = Network::random_initial_activity();
     }
     this->inputs = new std::vector<Input *>();
     this->neuron_inputs = new Vector(this->size);
 }
 
+real Network::random_initial_activity()
+{
+    return Random::uniform() * 0.0001;
+}
+
 Input *Network::add_input(Input *input)
 {
     input->initialize();
@@ -40,6 +46,12 @@ void Network::commit()
     Vector *prev_neurons = this->neurons[current_activity];
     this->neurons[current_activity] = this->neurons[next_activity];
     this->neurons[next_activity] = prev_neurons;
+    this->activity_changed();
+}
+
+void Network::activity_changed()
+{
+    this->activity_version++;
 }
 
 void Network::update_and_commit()
@@ -48,11 +60,33 @@ void Network::update_and_commit()
     this->commit();
 }
 
+NetworkKernel Network::compile_kernel()
+{
+    return NetworkKernel { Network::update_and_commit_kernel, this };
+}
+
+void Network::update_and_commit_kernel(void *network)
+{
+    ((Network *)network)->update_and_commit();
+}
+
 bool Network::should_update_neuron(int neuron_index)
 {
     return true;
 }
 
+const int *Network::get_enabled_neurons(int &count)
+{
+    if (this->all_neurons == nullptr) {
+        this->all_neurons = new int[this->size];
+        for (int i = 0; i < this->size; i++) {
+            this->all_neurons[i] = i;
+        }
+    }
+    count = this->size;
+    return this->all_neurons;
+}
+
 void Network::update_neuron_inputs()
 {
     this->neuron_inputs->clear();
@@ -63,9 +97,14 @@ void Network::update_neuron_inputs()
     }
 }
 
-Input::Input(Network *efferent)
-    : efferent(efferent)
+Input::Input(Network *efferent, Network *afferent)
+    : efferent(efferent), afferent_network(afferent)
+{
+}
+
+Input::~Input()
 {
+    delete this->memoized_contribution;
 }
 
 void Input::initialize()
@@ -81,3 +120,44 @@ bool Input::is_active()
 {
     return this->active;
 }
+
+Network *Input::get_afferent()
+{
+    return this->afferent_network;
+}
+
+bool Input::get_linear_source(Vector **&source, double &scale)
+{
+    return false;
+}
+
+void Input::memoize(Network *afferent)
+{
+    this->memoized_afferent = afferent;
+    this->memoized_contribution = new Vector(this->efferent->size);
+    this->memoized_valid = false;
+}
+
+bool Input::memoized_contribution_outdated()
+{
+    // The caller recalculates the contribution when told so, after which it
+    // holds for the current version of the afferent activity
+    if (this->memoized_valid &&
+            this->memoized_version == this->memoized_afferent->activity_version) {
+        return false;
+    }
+    this->memoized_version = this->memoized_afferent->activity_version;
+    this->memoized_valid = true;
+    return true;
+}
+
+void Input::add_memoized_contribution()
+{
+    Simd::axpy(this->efferent->neuron_inputs->values,
+        this->memoized_contribution->values, 1.0, this->efferent->size);
+}
+
+BatchInput::BatchInput(Network *efferent, Network *afferent)
+    : Input(efferent, afferent)
+{
+}
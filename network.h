@@ -22,15 +22,38 @@ enum NeuronActivity {
     NEURON_ACTIVITY_COUNT
 };
 
+// A compiled update and commit of a network, as a plain function and the
+// data that it works on, for schedules to call in place of the virtual
+// update_and_commit() of the network
+struct NetworkKernel {
+    void (*function)(void *data);
+    void *data;
+};
+
 class Network
 {
     public:
-        Network(int size);
+        Network(int size, bool random_activity = true);
         Input *add_input(Input *input);
         virtual void update();
         virtual void commit();
         void update_and_commit();
+        // The kernel that updates and commits the network. Networks whose
+        // inputs are all of kinds they know can fuse clearing, accumulating
+        // and committing into one pass, while any other network gets a
+        // kernel that calls update_and_commit(). The kernel reflects the
+        // inputs added so far
+        virtual NetworkKernel compile_kernel();
         virtual bool should_update_neuron(int neuron_index);
+        // The neurons for which should_update_neuron() holds, as a compacted
+        // list of indices, so that sparsely updated networks can skip the rest
+        virtual const int *get_enabled_neurons(int &count);
+        // Counts the changes of the current activity, so that inputs can
+        // tell whether their afferent has changed since they last read it.
+        // Each commit counts as a change, while code that writes the current
+        // activity directly must call activity_changed() afterwards
+        virtual void activity_changed();
+        unsigned long activity_version = 0;
 
         int size;
         Vector *neurons[NEURON_ACTIVITY_COUNT];
@@ -38,6 +61,9 @@ class Network
         Vector *neuron_inputs;
 
     protected:
+        static real random_initial_activity();
+        static void update_and_commit_kernel(void *network);
+        int *all_neurons = nullptr;
         void update_neuron_inputs();
         virtual void update_neuron_values() = 0;
 };
@@ -45,15 +71,53 @@ class Network
 class Input
 {
     public:
-        Input(Network *efferent);
+        Input(Network *efferent, Network *afferent = nullptr);
+        virtual ~Input();
         virtual void initialize();
         virtual void add_inputs() = 0;
         void set_active(bool active);
         bool is_active();
+        // The network whose current activity the input reads, if any, so
+        // that the topology of the networks can be recorded
+        Network *get_afferent();
+        // Inputs that add a scaled copy of a vector to the efferent neurons
+        // describe it here, so that the vector can be accumulated directly
+        // by a compiled kernel. The vector is given by the address of the
+        // pointer to it, as networks swap their vectors on each commit
+        virtual bool get_linear_source(Vector **&source, double &scale);
 
     protected:
         Network *efferent;
+        Network *afferent_network;
         bool active = true;
+
+        // Inputs whose contribution to the efferent neurons only depends on
+        // the current activity of one afferent network can memoize it, by
+        // calling memoize() with that network. The contribution is kept in
+        // memoized_contribution, which only needs to be recalculated when
+        // memoized_contribution_outdated() returns true, and is then added to
+        // the efferent neurons by add_memoized_contribution()
+        void memoize(Network *afferent);
+        bool memoized_contribution_outdated();
+        void add_memoized_contribution();
+        Vector *memoized_contribution = nullptr;
+        Network *memoized_afferent = nullptr;
+        unsigned long memoized_version = 0;
+        bool memoized_valid = false;
+};
+
+// Inputs from a single afferent network that can also evaluate themselves
+// for other activities of that network than its current one
+class BatchInput : public Input
+{
+    public:
+        BatchInput(Network *efferent, Network *afferent);
+        // Adds the contribution that the input would have for each of count
+        // alternative activities of its afferent network to the matching
+        // destination, leaving the state of the input and of both networks
+        // untouched
+        virtual void add_inputs_batch(const real *const *afferent_activities, int count,
+            real *const *destinations) = 0;
 };
 
 #endif
@@ -8,6 +8,11 @@
 #include "numerical.h"
 
 #include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include "simd.h"
 
 int round_up_to_nearest_multiple(int size, int multiple)
 {
@@ -37,6 +42,12 @@ Matrix::Matrix(int width, int height, real initial_value)
     }
 }
 
+Matrix::~Matrix()
+{
+    delete[] this->values;
+    delete[] this->raw_values;
+}
+
 Vector::Vector(int size)
     : Vector(size, 0.0)
 {
@@ -45,10 +56,12 @@ Vector::Vector(int size)
 Vector::Vector(int size, real initial_value)
     : size(size)
 {
-    int allocation_result = posix_memalign(
-        (void **)&this->values,
-        REAL_ALIGNMENT,
-        round_up_to_nearest_multiple(size, REAL_STRIDE) * sizeof(real));
+    if (posix_memalign(
+            (void **)&this->values,
+            REAL_ALIGNMENT,
+            round_up_to_nearest_multiple(size, REAL_STRIDE) * sizeof(real)) != 0) {
+        throw std::bad_alloc();
+    }
     for (int x = 0; x < size; x++) {
         this->values[x] = initial_value;
     }
@@ -56,29 +69,481 @@ Vector::Vector(int size, real initial_value)
 
 void Vector::clear()
 {
-    for (int x = 0; x < this->size; x++) {
-        this->values[x] = 0.0;
-    }
+    Simd::clear(this->values, this->size);
 }
 
 void Vector::copy_from(Vector *other)
 {
     assert(this->size == other->size);
-    for (int x = 0; x < this->size; x++) {
-        this->values[x] = other->values[x];
-    }
+    Simd::copy(this->values, other->values, this->size);
 }
 
 real Vector::sum()
 {
-    real sum = 0.0;
-    for (int x = 0; x < this->size; x++) {
-        sum += this->values[x];
+    return Simd::sum(this->values, this->size);
+}
+
+static uint16_t float_to_half(real value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint16_t sign = (bits >> 16) & 0x8000;
+    bits &= 0x7fffffff;
+    if (bits > 0x7f800000) {
+        return sign | 0x7e00;
+    } else if (bits >= 0x477ff000) {
+        // Rounds to above the largest half (65504)
+        return sign | 0x7c00;
+    } else if (bits < 0x38800000) {
+        // Below the smallest normal half (2^-14), so stored as a subnormal in
+        // units of 2^-24. Rounding up to 0x400 gives the smallest normal
+        return sign | (uint16_t)lrintf(fabsf(value) * 16777216.0f);
+    }
+    // Rebias the exponent from 127 to 15 and round the mantissa to nearest even
+    bits += 0xfff + ((bits >> 13) & 1);
+    return sign | ((bits - 0x38000000) >> 13);
+}
+
+static real half_to_float(uint16_t half)
+{
+    uint32_t sign = (uint32_t)(half & 0x8000) << 16;
+    uint32_t exponent = (half >> 10) & 0x1f;
+    uint32_t mantissa = half & 0x3ff;
+    uint32_t bits;
+    if (exponent == 0) {
+        real value = mantissa * (1.0f / 16777216.0f);
+        return sign ? -value : value;
+    } else if (exponent == 31) {
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    } else {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    }
+    real value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static uint16_t float_to_bfloat(real value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    if ((bits & 0x7fffffff) > 0x7f800000) {
+        return (bits >> 16) | 0x40;
+    }
+    bits += 0x7fff + ((bits >> 16) & 1);
+    return bits >> 16;
+}
+
+static real bfloat_to_float(uint16_t bfloat)
+{
+    uint32_t bits = (uint32_t)bfloat << 16;
+    real value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+CompactVector::CompactVector(int size, StoragePrecision precision)
+    : size(size), precision(precision), offset(0.0), scale(0.0)
+{
+    switch (precision) {
+    case storage_precision_fp32: this->data.resize(size * sizeof(real)); break;
+    case storage_precision_fp16: this->data.resize(size * sizeof(uint16_t)); break;
+    case storage_precision_bf16: this->data.resize(size * sizeof(uint16_t)); break;
+    case storage_precision_int8: this->data.resize(size); break;
+    default: assert(false);
+    }
+}
+
+const char *CompactVector::name(StoragePrecision precision)
+{
+    switch (precision) {
+    case storage_precision_fp32: return "fp32";
+    case storage_precision_fp16: return "fp16";
+    case storage_precision_bf16: return "bf16";
+    case storage_precision_int8: return "int8";
+    default: return "unknown";
+    }
+}
+
+void CompactVector::store(const real *values)
+{
+    uint16_t *halves = (uint16_t *)this->data.data();
+    switch (this->precision) {
+    case storage_precision_fp32:
+        memcpy(this->data.data(), values, this->size * sizeof(real));
+        break;
+    case storage_precision_fp16:
+        for (int i = 0; i < this->size; i++) {
+            halves[i] = float_to_half(values[i]);
+        }
+        break;
+    case storage_precision_bf16:
+        for (int i = 0; i < this->size; i++) {
+            halves[i] = float_to_bfloat(values[i]);
+        }
+        break;
+    case storage_precision_int8: {
+        real minimum = values[0], maximum = values[0];
+        for (int i = 1; i < this->size; i++) {
+            minimum = MIN(minimum, values[i]);
+            maximum = MAX(maximum, values[i]);
+        }
+        this->offset = minimum;
+        this->scale = (maximum - minimum) / 255.0;
+        real inverse_scale = (this->scale > 0.0 ? 1.0 / this->scale : 0.0);
+        for (int i = 0; i < this->size; i++) {
+            this->data[i] = (uint8_t)MIN(255, lrintf((values[i] - minimum) * inverse_scale));
+        }
+        break;
+    }
+    default:
+        assert(false);
+    }
+}
+
+void CompactVector::load(real *values)
+{
+    const uint16_t *halves = (const uint16_t *)this->data.data();
+    switch (this->precision) {
+    case storage_precision_fp32:
+        memcpy(values, this->data.data(), this->size * sizeof(real));
+        break;
+    case storage_precision_fp16:
+        for (int i = 0; i < this->size; i++) {
+            values[i] = half_to_float(halves[i]);
+        }
+        break;
+    case storage_precision_bf16:
+        for (int i = 0; i < this->size; i++) {
+            values[i] = bfloat_to_float(halves[i]);
+        }
+        break;
+    case storage_precision_int8:
+        for (int i = 0; i < this->size; i++) {
+            values[i] = this->offset + this->scale * this->data[i];
+        }
+        break;
+    default:
+        assert(false);
+    }
+}
+
+int CompactVector::storage_bytes()
+{
+    return this->data.size();
+}
+
+PaddedSheet::PaddedSheet(int width, int height, int halo)
+    : width(width), height(height), halo(halo)
+{
+    assert(halo <= width && halo <= height);
+    int left_padding = round_up_to_nearest_multiple(halo, REAL_STRIDE);
+    this->stride = round_up_to_nearest_multiple(left_padding + width + halo, REAL_STRIDE);
+    if (posix_memalign(
+            (void **)&this->raw_values,
+            REAL_ALIGNMENT,
+            (height + 2 * halo) * this->stride * sizeof(real)) != 0) {
+        throw std::bad_alloc();
+    }
+    for (int i = 0; i < (height + 2 * halo) * this->stride; i++) {
+        this->raw_values[i] = 0.0;
+    }
+    this->origin = &this->raw_values[halo * this->stride + left_padding];
+}
+
+PaddedSheet::~PaddedSheet()
+{
+    free(this->raw_values);
+}
+
+void PaddedSheet::refresh(const real *values)
+{
+    for (int y = -this->halo; y < this->height + this->halo; y++) {
+        int source_y = y;
+        if (source_y < 0) {
+            source_y += this->height;
+        } else if (source_y >= this->height) {
+            source_y -= this->height;
+        }
+        const real *source = &values[source_y * this->width];
+        real *destination = &this->origin[y * this->stride];
+        Simd::copy(destination, source, this->width);
+        for (int x = 1; x < this->halo + 1; x++) {
+            destination[-x] = source[this->width - x];
+            destination[this->width + x - 1] = source[x - 1];
+        }
+    }
+}
+
+FourierTransform::FourierTransform(int size)
+    : size(size)
+{
+    // Factorize the transform size into the radices of the mixed-radix
+    // recursion, preferring the small radices. Any remaining prime factors
+    // are handled by the generic butterfly in transform_recursive()
+    int remaining = size;
+    for (int radix : { 4, 2, 3, 5 }) {
+        while (remaining % radix == 0) {
+            this->factors.push_back(radix);
+            remaining /= radix;
+        }
+    }
+    for (int radix = 7; remaining > 1; radix += 2) {
+        while (remaining % radix == 0) {
+            this->factors.push_back(radix);
+            remaining /= radix;
+        }
+    }
+
+    // Precompute the twiddle factors for each level of the recursion. At the
+    // level transforming length n = p * m, the m subtransforms are combined
+    // using the twiddles w^(q * k) for q < p, k < m, followed by a length-p
+    // DFT with the factors w^(q * u * m), where w = exp(-+2 pi i / n)
+    int n = size;
+    for (int radix : this->factors) {
+        int m = n / radix;
+        this->lengths.push_back(n);
+        for (int direction = 0; direction < 2; direction++) {
+            double sign = (direction == 0 ? -1.0 : 1.0);
+            std::vector<complex_real> twiddles, butterflies;
+            for (int k = 0; k < m; k++) {
+                for (int q = 0; q < radix; q++) {
+                    double angle = sign * 2 * M_PI * q * k / n;
+                    twiddles.push_back(complex_real(std::cos(angle), std::sin(angle)));
+                }
+            }
+            for (int u = 0; u < radix; u++) {
+                for (int q = 0; q < radix; q++) {
+                    double angle = sign * 2 * M_PI * ((q * u) % radix) / radix;
+                    butterflies.push_back(complex_real(std::cos(angle), std::sin(angle)));
+                }
+            }
+            this->twiddles[direction].push_back(twiddles);
+            this->butterflies[direction].push_back(butterflies);
+        }
+        n = m;
+    }
+}
+
+void FourierTransform::transform(const complex_real *input, int input_stride,
+        complex_real *output, int batch, bool inverse)
+{
+    // Transforms (batch) independent sequences at once. Each sample is a
+    // contiguous run of (batch) values, one per sequence, and consecutive
+    // input samples are (input_stride) values apart. The output samples are
+    // stored contiguously, i.e. (batch) values apart. Working on whole runs
+    // keeps the innermost loops contiguous, so that they can be vectorized.
+    // The inverse transform is left unnormalized, i.e. scaled by the size
+    if (this->factors.empty()) {
+        for (int b = 0; b < batch; b++) {
+            output[b] = input[b];
+        }
+        return;
+    }
+    this->transform_recursive(input, output, input_stride, batch, 0, inverse ? 1 : 0);
+}
+
+void FourierTransform::transform_recursive(const complex_real *input, complex_real *output,
+        int input_stride, int batch, int factor_index, int direction)
+{
+    int p = this->factors[factor_index];
+    int m = this->lengths[factor_index] / p;
+    const complex_real *twiddles = this->twiddles[direction][factor_index].data();
+    const complex_real *butterflies = this->butterflies[direction][factor_index].data();
+
+    // Decimation in time: transform each of the p interleaved subsequences
+    // into consecutive blocks of length m in the output, and then combine
+    // them with radix-p butterflies. At the last level the subsequences have
+    // length one, and the butterflies can read straight from the input
+    const complex_real *sources = output;
+    int source_stride = m * batch;
+    if (m == 1) {
+        sources = input;
+        source_stride = input_stride;
+    } else {
+        for (int q = 0; q < p; q++) {
+            this->transform_recursive(input + q * input_stride, output + q * m * batch,
+                input_stride * p, batch, factor_index + 1, direction);
+        }
+    }
+
+    complex_real small_butterfly[8];
+    std::vector<complex_real> large_butterfly;
+    complex_real *butterfly = small_butterfly;
+    if (p > 8) {
+        large_butterfly.resize(p);
+        butterfly = large_butterfly.data();
+    }
+    complex_real rotation(0.0, direction == 0 ? -1.0 : 1.0);
+    for (int k = 0; k < m; k++) {
+        const complex_real *source = sources + k * batch;
+        complex_real *destination = output + k * batch;
+        const complex_real *twiddle = twiddles + k * p;
+        if (p == 2) {
+            for (int b = 0; b < batch; b++) {
+                complex_real b0 = source[b];
+                complex_real b1 = source[source_stride + b] * twiddle[1];
+                destination[b] = b0 + b1;
+                destination[m * batch + b] = b0 - b1;
+            }
+        } else if (p == 4) {
+            // The radix-4 butterfly only needs rotations by +-i
+            for (int b = 0; b < batch; b++) {
+                complex_real b0 = source[b];
+                complex_real b1 = source[source_stride + b] * twiddle[1];
+                complex_real b2 = source[2 * source_stride + b] * twiddle[2];
+                complex_real b3 = source[3 * source_stride + b] * twiddle[3];
+                complex_real even_sum = b0 + b2;
+                complex_real even_difference = b0 - b2;
+                complex_real odd_sum = b1 + b3;
+                complex_real odd_difference = (b1 - b3) * rotation;
+                destination[b] = even_sum + odd_sum;
+                destination[m * batch + b] = even_difference + odd_difference;
+                destination[2 * m * batch + b] = even_sum - odd_sum;
+                destination[3 * m * batch + b] = even_difference - odd_difference;
+            }
+        } else {
+            for (int b = 0; b < batch; b++) {
+                for (int q = 0; q < p; q++) {
+                    butterfly[q] = source[q * source_stride + b] * twiddle[q];
+                }
+                for (int u = 0; u < p; u++) {
+                    complex_real sum = butterfly[0];
+                    for (int q = 1; q < p; q++) {
+                        sum += butterfly[q] * butterflies[u * p + q];
+                    }
+                    destination[u * m * batch + b] = sum;
+                }
+            }
+        }
+    }
+}
+
+PeriodicCorrelation::PeriodicCorrelation(Matrix *kernel)
+    : width(kernel->width), height(kernel->height),
+      pair_count((kernel->width + 1) / 2),
+      spectrum_height(kernel->height / 2 + 1)
+{
+    this->row_transform = new FourierTransform(this->width);
+    this->column_transform = new FourierTransform(this->height);
+
+    // Precompute the conjugated kernel spectrum, with the normalization of
+    // the inverse transform folded in, so that correlate() only needs one
+    // complex multiplication per frequency
+    std::vector<complex_real> workspace(this->workspace_size());
+    this->kernel_spectrum.resize(this->width * this->spectrum_height);
+    this->forward(kernel->raw_values, this->kernel_spectrum.data(), workspace.data());
+    real normalization = 1.0 / (this->width * this->height);
+    for (complex_real &value : this->kernel_spectrum) {
+        value = std::conj(value) * normalization;
+    }
+}
+
+PeriodicCorrelation::~PeriodicCorrelation()
+{
+    delete this->row_transform;
+    delete this->column_transform;
+}
+
+int PeriodicCorrelation::workspace_size()
+{
+    return 2 * this->height * this->pair_count + 2 * this->width * this->spectrum_height;
+}
+
+void PeriodicCorrelation::correlate(const real *input, real *output, complex_real *workspace)
+{
+    // Calculates output[sy][sx] = sum_{y,x} input[y][x] * kernel[y - sy][x - sx]
+    // with all indices wrapped around. By the correlation theorem, the
+    // spectrum of the output is FFT(input) * conj(FFT(kernel))
+    complex_real *spectrum = workspace;
+    complex_real *buffers = workspace + this->width * this->spectrum_height;
+    this->forward(input, spectrum, buffers);
+    for (int i = 0; i < this->width * this->spectrum_height; i++) {
+        spectrum[i] *= this->kernel_spectrum[i];
+    }
+    this->inverse(spectrum, output, buffers);
+}
+
+void PeriodicCorrelation::forward(const real *input, complex_real *spectrum, complex_real *buffers)
+{
+    // The spectrum is stored transposed, with spectrum[kx][ky], and only
+    // for the non-redundant half 0 <= ky <= height / 2 of the frequencies
+    int w = this->width;
+    int h = this->height;
+    int pairs = this->pair_count;
+    int sh = this->spectrum_height;
+    complex_real *packed = buffers;
+    complex_real *transformed = packed + h * pairs;
+    complex_real *half_spectrum = transformed + h * pairs;
+
+    // Real-to-complex column transforms. Column j is packed together with
+    // column (j + pairs) into the real and imaginary parts of one complex
+    // column, and their (Hermitian) spectra are separated afterwards
+    for (int y = 0; y < h; y++) {
+        for (int j = 0; j < pairs; j++) {
+            real paired_value = (j + pairs < w ? input[y * w + j + pairs] : 0.0);
+            packed[y * pairs + j] = complex_real(input[y * w + j], paired_value);
+        }
+    }
+    this->column_transform->transform(packed, pairs, transformed, pairs, false);
+    for (int j = 0; j < pairs; j++) {
+        for (int ky = 0; ky < sh; ky++) {
+            complex_real z = transformed[ky * pairs + j];
+            complex_real z_mirror = std::conj(transformed[((h - ky) % h) * pairs + j]);
+            half_spectrum[j * sh + ky] = (z + z_mirror) * (real)0.5;
+            if (j + pairs < w) {
+                half_spectrum[(j + pairs) * sh + ky] = (z - z_mirror) * complex_real(0.0, -0.5);
+            }
+        }
+    }
+
+    // Complex row transforms for each of the retained column frequencies
+    this->row_transform->transform(half_spectrum, sh, spectrum, sh, false);
+}
+
+void PeriodicCorrelation::inverse(complex_real *spectrum, real *output, complex_real *buffers)
+{
+    int w = this->width;
+    int h = this->height;
+    int pairs = this->pair_count;
+    int sh = this->spectrum_height;
+    complex_real *packed = buffers;
+    complex_real *transformed = packed + h * pairs;
+    complex_real *half_spectrum = transformed + h * pairs;
+
+    this->row_transform->transform(spectrum, sh, half_spectrum, sh, true);
+
+    // Complex-to-real column transforms, again two columns at a time. The
+    // full column spectra are restored from their Hermitian halves and
+    // combined as X1 + i * X2, whose inverse transform then carries the two
+    // real columns in its real and imaginary parts
+    for (int ky = 0; ky < h; ky++) {
+        for (int j = 0; j < pairs; j++) {
+            complex_real x1, x2;
+            if (ky < sh) {
+                x1 = half_spectrum[j * sh + ky];
+                x2 = (j + pairs < w ? half_spectrum[(j + pairs) * sh + ky] : 0.0);
+            } else {
+                x1 = std::conj(half_spectrum[j * sh + (h - ky)]);
+                x2 = (j + pairs < w ? std::conj(half_spectrum[(j + pairs) * sh + (h - ky)]) : 0.0);
+            }
+            packed[ky * pairs + j] = x1 + complex_real(0.0, 1.0) * x2;
+        }
+    }
+    this->column_transform->transform(packed, pairs, transformed, pairs, true);
+    for (int y = 0; y < h; y++) {
+        for (int j = 0; j < pairs; j++) {
+            output[y * w + j] = transformed[y * pairs + j].real();
+            if (j + pairs < w) {
+                output[y * w + j + pairs] = transformed[y * pairs + j].imag();
+            }
+        }
     }
-    return sum;
 }
 
 bool Random::initialized = false;
+uint32_t Random::seed_value = 0;
+bool Random::seeded = false;
 std::mt19937 *Random::engine = nullptr;
 std::uniform_real_distribution<real> *Random::uniform_distribution = nullptr;
 std::normal_distribution<real> *Random::normal_distribution = nullptr;
@@ -99,11 +564,80 @@ double Random::normal()
     return (*Random::normal_distribution)(*Random::engine);
 }
 
+void Random::seed(uint32_t seed)
+{
+    if (!Random::initialized) {
+        Random::initialize();
+    }
+    Random::seed_value = seed;
+    Random::seeded = true;
+    Random::engine->seed(seed);
+}
+
+uint32_t Random::get_seed()
+{
+    if (!Random::initialized) {
+        Random::initialize();
+    }
+    return Random::seed_value;
+}
+
+bool Random::is_seeded()
+{
+    return Random::seeded;
+}
+
 void Random::initialize()
 {
     std::random_device random_device;
-    Random::engine = new std::mt19937(random_device());
+    Random::seed_value = random_device();
+    Random::engine = new std::mt19937(Random::seed_value);
     Random::uniform_distribution = new std::uniform_real_distribution<real>();
     Random::normal_distribution = new std::normal_distribution<real>();
     Random::initialized = true;
 }
+
+void Random::counter_uniforms(uint32_t stream, uint64_t step,
+        uint32_t first_block, int block_count, real *output)
+{
+    if (!Random::initialized) {
+        Random::initialize();
+    }
+    // The blocks are generated in groups, with the rounds as the outer loop
+    // and the blocks of the group as the inner one, so that the latter can
+    // be vectorized
+    const int group_size = 16;
+    uint32_t c0[group_size], c1[group_size], c2[group_size], c3[group_size];
+    for (int first = 0; first < block_count; first += group_size) {
+        int count = MIN(group_size, block_count - first);
+        for (int i = 0; i < count; i++) {
+            c0[i] = first_block + first + i;
+            c1[i] = stream;
+            c2[i] = (uint32_t)step;
+            c3[i] = (uint32_t)(step >> 32);
+        }
+        uint32_t k0 = Random::seed_value, k1 = 0x9e3779b9;
+        for (int round = 0; round < 10; round++) {
+            for (int i = 0; i < count; i++) {
+                uint64_t product0 = (uint64_t)0xd2511f53 * c0[i];
+                uint64_t product1 = (uint64_t)0xcd9e8d57 * c2[i];
+                uint32_t n0 = (uint32_t)(product1 >> 32) ^ c1[i] ^ k0;
+                uint32_t n2 = (uint32_t)(product0 >> 32) ^ c3[i] ^ k1;
+                c0[i] = n0;
+                c1[i] = (uint32_t)product1;
+                c2[i] = n2;
+                c3[i] = (uint32_t)product0;
+            }
+            k0 += 0x9e3779b9;
+            k1 += 0xbb67ae85;
+        }
+        // Use the upper 24 bits of each word, mapped to (0, 1]
+        for (int i = 0; i < count; i++) {
+            real *values = &output[4 * (first + i)];
+            values[0] = ((c0[i] >> 8) + 1) * (1.0f / 16777216.0f);
+            values[1] = ((c1[i] >> 8) + 1) * (1.0f / 16777216.0f);
+            values[2] = ((c2[i] >> 8) + 1) * (1.0f / 16777216.0f);
+            values[3] = ((c3[i] >> 8) + 1) * (1.0f / 16777216.0f);
+        }
+    }
+}
@@ -9,18 +9,25 @@
 #define NUMERICAL_H_INCLUDED
 
 #include <cmath>
+#include <complex>
+#include <cstdint>
 #include <random>
+#include <vector>
 
 #include "main.h"
 
 typedef float real;
 typedef real aligned_real __attribute__((aligned(REAL_ALIGNMENT)));
+typedef std::complex<real> complex_real;
+
+int round_up_to_nearest_multiple(int size, int multiple);
 
 class Matrix
 {
     public:
         Matrix(int width, int height);
         Matrix(int width, int height, real initial_value);
+        ~Matrix();
 
         int width;
         int height;
@@ -42,15 +49,115 @@ class Vector
         aligned_real *values;
 };
 
+// A vector kept in reduced precision, for activity that is only stored and
+// later loaded back as floats, such as the grid states of place cells. The
+// int8 format maps the range between the smallest and largest value of the
+// stored vector linearly onto 0, ..., 255
+class CompactVector
+{
+    public:
+        CompactVector(int size, StoragePrecision precision);
+        static const char *name(StoragePrecision precision);
+        void store(const real *values);
+        void load(real *values);
+        int storage_bytes();
+
+        int size;
+        StoragePrecision precision;
+
+    protected:
+        std::vector<uint8_t> data;
+        real offset;
+        real scale;
+};
+
+// A toroidal sheet stored with a halo of (halo) extra rows and columns on
+// each side, holding copies of the cells on the opposite edges. Stencils
+// that look at most (halo) cells away can then read rows contiguously with
+// no wrapping. Rows are padded to a multiple of REAL_STRIDE values, and the
+// leftmost interior column is aligned to REAL_ALIGNMENT
+class PaddedSheet
+{
+    public:
+        PaddedSheet(int width, int height, int halo);
+        ~PaddedSheet();
+        void refresh(const real *values);
+        inline const real *row(int y) { return &this->origin[y * this->stride]; }
+
+        int width;
+        int height;
+        int halo;
+        int stride;
+        real *origin;
+
+    protected:
+        real *raw_values;
+};
+
+class FourierTransform
+{
+    public:
+        FourierTransform(int size);
+        void transform(const complex_real *input, int input_stride,
+            complex_real *output, int batch, bool inverse);
+
+        int size;
+
+    protected:
+        std::vector<int> factors;
+        std::vector<int> lengths;
+        std::vector<std::vector<complex_real>> twiddles[2];
+        std::vector<std::vector<complex_real>> butterflies[2];
+
+        void transform_recursive(const complex_real *input, complex_real *output,
+            int input_stride, int batch, int factor_index, int direction);
+};
+
+class PeriodicCorrelation
+{
+    public:
+        PeriodicCorrelation(Matrix *kernel);
+        ~PeriodicCorrelation();
+        int workspace_size();
+        void correlate(const real *input, real *output, complex_real *workspace);
+
+        int width;
+        int height;
+        int pair_count;
+        int spectrum_height;
+
+    protected:
+        FourierTransform *row_transform;
+        FourierTransform *column_transform;
+        std::vector<complex_real> kernel_spectrum;
+
+        void forward(const real *input, complex_real *spectrum, complex_real *buffers);
+        void inverse(complex_real *spectrum, real *output, complex_real *buffers);
+};
+
 class Random
 {
     public:
         static double uniform();
         static double normal();
+        static void seed(uint32_t seed);
+        static uint32_t get_seed();
+        // Whether the seed was given by seed(), rather than drawn at random
+        static bool is_seeded();
+
+        // Counter-based generator (Philox4x32-10), for streams that must not
+        // depend on the order in which they are drawn. Fills output with
+        // 4 * block_count uniforms in (0, 1], namely the blocks first_block,
+        // ..., first_block + block_count - 1 of the sequence keyed by the
+        // seed, the stream and the step
+        static void counter_uniforms(uint32_t stream, uint64_t step,
+            uint32_t first_block, int block_count, real *output);
 
     protected:
         static bool initialized;
         static void initialize();
+        static uint32_t seed_value;
+        static bool seeded;
 
         static std::mt19937 *engine;
         static std::uniform_real_distribution<real> *uniform_distribution;
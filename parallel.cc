@@ -0,0 +1,222 @@
+// Navigating with grid and place cells in cluttered environments
+// Edvardsen et al. (2020). Hippocampus, 30(3), 220-232.
+//
+// Licensed under the EUPL-1.2-or-later.
+// Copyright (c) 2019 NTNU - Norwegian University of Science and Technology.
+// Author: Vegard Edvardsen (https://github.com/evegard).
+
+#include "parallel.h"
+
+#include <cassert>
+#include <immintrin.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "main.h"
+
+ThreadPool::ThreadPool(int thread_count, bool pin_threads)
+    : thread_count(thread_count < 1 ? 1 : thread_count),
+      task(nullptr), batch(0), finished_count(0), stopping(false)
+{
+    this->spin_iterations = this->thread_count <= ThreadPool::core_count() ?
+        THREAD_POOL_SPIN_ITERATIONS : 0;
+    // Only the workers are pinned, each to a core of the process's affinity
+    // set after the first, which is left to the caller. The affinity of the
+    // caller itself is left as it is
+    std::vector<int> cores;
+    if (pin_threads) {
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &allowed)) {
+                    cores.push_back(cpu);
+                }
+            }
+        }
+    }
+    for (int i = 1; i < this->thread_count; i++) {
+        int core = cores.empty() ? -1 : cores[i % cores.size()];
+        this->threads.push_back(std::thread(&ThreadPool::work, this, core));
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopping = true;
+    }
+    this->batch_started.notify_all();
+    for (std::thread &thread : this->threads) {
+        thread.join();
+    }
+}
+
+void ThreadPool::run(int task_count, std::function<void(int)> task)
+{
+    if (this->threads.empty() || task_count <= 1) {
+        for (int i = 0; i < task_count; i++) {
+            task(i);
+        }
+        return;
+    }
+    assert(task_count <= 0xffff);
+
+    // Publish the batch. Taking the lock in between makes sure that a worker
+    // that is just about to sleep either sees the new generation or is
+    // woken up by the notification
+    uint32_t generation = ThreadPool::batch_generation(this->batch.load()) + 1;
+    this->task = &task;
+    this->finished_count.store(0);
+    this->batch.store(((uint64_t)generation << 32) | ((uint64_t)task_count << 16),
+        std::memory_order_release);
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+    }
+    this->batch_started.notify_all();
+
+    this->run_tasks(generation);
+    for (int spin = 0; this->finished_count.load(std::memory_order_acquire) != task_count; spin++) {
+        if (spin < this->spin_iterations) {
+            _mm_pause();
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->batch_finished.wait(lock, [this, task_count] {
+            return this->finished_count.load() == task_count; });
+        break;
+    }
+    this->task = nullptr;
+}
+
+void ThreadPool::run_on(ThreadPool *pool, int task_count, std::function<void(int)> task)
+{
+    if (pool != nullptr) {
+        pool->run(task_count, task);
+        return;
+    }
+    for (int i = 0; i < task_count; i++) {
+        task(i);
+    }
+}
+
+void ThreadPool::work(int core)
+{
+    if (core >= 0) {
+        ThreadPool::pin_to_core(core);
+    }
+    uint32_t seen_generation = 0;
+    while (true) {
+        for (int spin = 0; !this->stopping.load() &&
+                ThreadPool::batch_generation(this->batch.load()) == seen_generation; spin++) {
+            if (spin < this->spin_iterations) {
+                _mm_pause();
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->batch_started.wait(lock, [this, seen_generation] {
+                return this->stopping.load() ||
+                    ThreadPool::batch_generation(this->batch.load()) != seen_generation; });
+            break;
+        }
+        if (this->stopping.load()) {
+            return;
+        }
+        seen_generation = ThreadPool::batch_generation(this->batch.load(std::memory_order_acquire));
+        this->run_tasks(seen_generation);
+    }
+}
+
+void ThreadPool::run_tasks(uint32_t generation)
+{
+    // Claim tasks one at a time until there are none left in the batch. A
+    // claim only succeeds while the batch is still of the given generation,
+    // and the caller cannot start the next batch before every claimed task
+    // has finished, so the task function stays valid while it runs
+    uint64_t batch = this->batch.load(std::memory_order_acquire);
+    while (ThreadPool::batch_generation(batch) == generation &&
+            ThreadPool::batch_next_task(batch) < ThreadPool::batch_task_count(batch)) {
+        if (!this->batch.compare_exchange_weak(batch, batch + 1, std::memory_order_acq_rel)) {
+            continue;
+        }
+        int task_count = ThreadPool::batch_task_count(batch);
+        (*this->task)(ThreadPool::batch_next_task(batch));
+        if (this->finished_count.fetch_add(1, std::memory_order_acq_rel) + 1 == task_count) {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->batch_finished.notify_all();
+        }
+        batch = this->batch.load(std::memory_order_acquire);
+    }
+}
+
+void ThreadPool::pin_to_core(int core)
+{
+    cpu_set_t cores;
+    CPU_ZERO(&cores);
+    CPU_SET(core, &cores);
+    pthread_setaffinity_np(pthread_self(), sizeof(cores), &cores);
+}
+
+int TaskGraph::add_task(std::string name, std::function<void()> task,
+        std::vector<int> dependencies)
+{
+    int index = this->tasks.size();
+    int stage = 0;
+    for (int dependency : dependencies) {
+        assert(dependency >= 0 && dependency < index);
+        stage = MAX(stage, this->task_stages[dependency] + 1);
+    }
+    if (stage >= (int)this->stages.size()) {
+        this->stages.resize(stage + 1);
+    }
+    this->stages[stage].push_back(index);
+    this->task_stages.push_back(stage);
+    this->names.push_back(name);
+    this->tasks.push_back(task);
+    this->dependencies.push_back(dependencies);
+    return index;
+}
+
+void TaskGraph::run(ThreadPool *pool)
+{
+    for (std::vector<int> &stage : this->stages) {
+        ThreadPool::run_on(pool, stage.size(), [this, &stage](int i) {
+            this->tasks[stage[i]]();
+        });
+    }
+}
+
+int TaskGraph::get_width()
+{
+    int width = 0;
+    for (std::vector<int> &stage : this->stages) {
+        width = MAX(width, (int)stage.size());
+    }
+    return width;
+}
+
+void TaskGraph::dump(std::ostream &stream)
+{
+    stream << "digraph tasks {" << std::endl;
+    for (int stage = 0; stage < (int)this->stages.size(); stage++) {
+        stream << "    { rank=same;";
+        for (int task : this->stages[stage]) {
+            stream << " \"" << this->names[task] << "\";";
+        }
+        stream << " }" << std::endl;
+    }
+    for (int task = 0; task < (int)this->tasks.size(); task++) {
+        for (int dependency : this->dependencies[task]) {
+            stream << "    \"" << this->names[dependency] << "\" -> \""
+                << this->names[task] << "\";" << std::endl;
+        }
+    }
+    stream << "}" << std::endl;
+}
+
+int ThreadPool::core_count()
+{
+    int core_count = std::thread::hardware_concurrency();
+    return core_count > 0 ? core_count : 1;
+}
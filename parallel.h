@@ -0,0 +1,99 @@
+// Navigating with grid and place cells in cluttered environments
+// Edvardsen et al. (2020). Hippocampus, 30(3), 220-232.
+//
+// Licensed under the EUPL-1.2-or-later.
+// Copyright (c) 2019 NTNU - Norwegian University of Science and Technology.
+// Author: Vegard Edvardsen (https://github.com/evegard).
+
+#ifndef PARALLEL_H_INCLUDED
+#define PARALLEL_H_INCLUDED
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads that run batches of independent tasks. The
+// calling thread takes part in each batch, so a pool of one thread runs
+// everything on the caller without any synchronization.
+//
+// As batches may be as short as a single timestep of a few modules, the
+// threads spin for a while before they go to sleep, both while the workers
+// wait for the next batch and while the caller waits for the batch to finish,
+// provided that there are at least as many cores as threads. Optionally, each
+// worker is pinned to its own core, leaving the first of the cores that the
+// process may run on to the caller, whose affinity is not touched
+class ThreadPool
+{
+    public:
+        ThreadPool(int thread_count, bool pin_threads = false);
+        ~ThreadPool();
+        // Run task(0), ..., task(task_count - 1), in any order and on any of
+        // the threads, and return once all of them have finished
+        void run(int task_count, std::function<void(int)> task);
+        // Run the tasks on the pool, or in turn on the caller if it is null
+        static void run_on(ThreadPool *pool, int task_count, std::function<void(int)> task);
+        // The number of cores of the machine
+        static int core_count();
+
+        int thread_count;
+
+    protected:
+        // Spinning only pays off while every thread has a core of its own
+        int spin_iterations;
+
+        std::vector<std::thread> threads;
+        std::mutex mutex;
+        std::condition_variable batch_started;
+        std::condition_variable batch_finished;
+
+        // The current batch. Its generation, task count and the index of the
+        // next task to claim are packed into one word, so that a thread that
+        // is late for a batch can never claim a task of the one after it
+        std::function<void(int)> *task;
+        std::atomic<uint64_t> batch;
+        std::atomic<int> finished_count;
+        std::atomic<bool> stopping;
+
+        static uint32_t batch_generation(uint64_t batch) { return batch >> 32; }
+        static int batch_task_count(uint64_t batch) { return (batch >> 16) & 0xffff; }
+        static int batch_next_task(uint64_t batch) { return batch & 0xffff; }
+
+        // Each worker runs work() with the core to pin itself to, or -1
+        void work(int core);
+        void run_tasks(uint32_t generation);
+        static void pin_to_core(int core);
+};
+
+// Named tasks with dependencies between them, run together as one unit. Each
+// task only runs once the tasks it depends on have finished, and is otherwise
+// free to run at the same time as any other task. The tasks are grouped into
+// stages by the longest chain of dependencies leading up to them, and the
+// tasks of each stage run in parallel on a pool
+class TaskGraph
+{
+    public:
+        // Adds a task depending on the given, earlier added tasks, returning
+        // the task to refer to it by in the dependencies of later tasks
+        int add_task(std::string name, std::function<void()> task,
+            std::vector<int> dependencies = std::vector<int>());
+        void run(ThreadPool *pool);
+        // The largest number of tasks that can run at the same time
+        int get_width();
+        // Writes the tasks and their dependencies in the Graphviz format
+        void dump(std::ostream &stream);
+
+    protected:
+        std::vector<std::string> names;
+        std::vector<std::function<void()>> tasks;
+        std::vector<std::vector<int>> dependencies;
+        std::vector<int> task_stages;
+        std::vector<std::vector<int>> stages;
+};
+
+#endif
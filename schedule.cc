@@ -0,0 +1,223 @@
+// Navigating with grid and place cells in cluttered environments
+// Edvardsen et al. (2020). Hippocampus, 30(3), 220-232.
+//
+// Licensed under the EUPL-1.2-or-later.
+// Copyright (c) 2019 NTNU - Norwegian University of Science and Technology.
+// Author: Vegard Edvardsen (https://github.com/evegard).
+
+#include "schedule.h"
+
+#include <algorithm>
+#include <cassert>
+
+void NetworkSchedule::add_source(Network *network)
+{
+    this->sources.push_back(network);
+}
+
+void NetworkSchedule::add_stage(const std::vector<Network *> &networks,
+        std::function<void(ThreadPool *)> stage)
+{
+    Step step;
+    step.networks = networks;
+    step.stage = stage;
+    for (Network *network : networks) {
+        assert(this->step_of.count(network) == 0);
+        this->step_of[network] = this->steps.size();
+    }
+    this->steps.push_back(step);
+}
+
+int NetworkSchedule::add_output(const std::vector<Network *> &networks)
+{
+    this->outputs.push_back(networks);
+    return this->outputs.size() - 1;
+}
+
+int NetworkSchedule::get_step(Network *network)
+{
+    // Networks that are not part of a stage get a step of their own
+    auto iter = this->step_of.find(network);
+    if (iter != this->step_of.end()) {
+        return iter->second;
+    }
+    Step step;
+    step.networks.push_back(network);
+    step.kernel = network->compile_kernel();
+    this->step_of[network] = this->steps.size();
+    this->steps.push_back(step);
+    return this->steps.size() - 1;
+}
+
+void NetworkSchedule::compile()
+{
+    std::vector<int> source_steps;
+    for (Network *source : this->sources) {
+        source_steps.push_back(this->get_step(source));
+    }
+    std::vector<std::vector<int>> output_roots;
+    for (std::vector<Network *> &output : this->outputs) {
+        output_roots.push_back(std::vector<int>());
+        for (Network *network : output) {
+            output_roots.back().push_back(this->get_step(network));
+        }
+    }
+
+    for (int step : source_steps) {
+        this->visit_states[step] = visited;
+    }
+    for (std::vector<int> &roots : output_roots) {
+        for (int step : roots) {
+            this->visit(step);
+        }
+    }
+    this->visit_states.clear();
+
+    // As the steps are in order, going through them backwards reaches every
+    // step that an output needs before the steps that it reads from
+    for (std::vector<int> &roots : output_roots) {
+        std::vector<bool> needed(this->steps.size(), false);
+        for (int step : roots) {
+            needed[step] = true;
+        }
+        for (auto iter = this->order.rbegin(); iter != this->order.rend(); iter++) {
+            if (needed[*iter]) {
+                for (int afferent : this->steps[*iter].afferents) {
+                    needed[afferent] = true;
+                }
+            }
+        }
+        this->output_steps.push_back(needed);
+    }
+
+    this->group_tasks();
+}
+
+void NetworkSchedule::visit(int step)
+{
+    if (this->visit_states[step] == visited) {
+        return;
+    }
+    // Reaching a step that is still being visited means that the steps
+    // read from each other in a cycle, which has no valid order
+    assert(this->visit_states[step] != visiting);
+    this->visit_states[step] = visiting;
+    std::vector<Network *> networks = this->steps[step].networks;
+    for (Network *network : networks) {
+        for (Input *input : *network->inputs) {
+            Network *afferent = input->get_afferent();
+            if (afferent == nullptr) {
+                continue;
+            }
+            int afferent_step = this->get_step(afferent);
+            std::vector<int> &afferents = this->steps[step].afferents;
+            if (afferent_step == step || std::find(afferents.begin(), afferents.end(),
+                    afferent_step) != afferents.end()) {
+                continue;
+            }
+            this->visit(afferent_step);
+            // Sources are only read, and do not constrain the schedule
+            if (std::find(this->sources.begin(), this->sources.end(), afferent) ==
+                    this->sources.end()) {
+                this->steps[step].afferents.push_back(afferent_step);
+            }
+        }
+    }
+    this->visit_states[step] = visited;
+    this->order.push_back(step);
+}
+
+void NetworkSchedule::group_tasks()
+{
+    // The number of steps of the schedule that read from each step
+    std::vector<int> reader_counts(this->steps.size(), 0);
+    for (int step : this->order) {
+        for (int afferent : this->steps[step].afferents) {
+            reader_counts[afferent]++;
+        }
+    }
+
+    // As the steps are in order, the afferents of each step already have
+    // their tasks, and the tasks their levels
+    std::vector<int> task_of(this->steps.size(), -1);
+    std::vector<int> level_of;
+    for (int step : this->order) {
+        std::vector<int> &afferents = this->steps[step].afferents;
+        if (afferents.size() == 1 && reader_counts[afferents[0]] == 1) {
+            int task = task_of[afferents[0]];
+            this->tasks[task].push_back(step);
+            task_of[step] = task;
+            continue;
+        }
+        int level = 0;
+        for (int afferent : afferents) {
+            level = std::max(level, level_of[task_of[afferent]] + 1);
+        }
+        task_of[step] = this->tasks.size();
+        this->tasks.push_back(std::vector<int>(1, step));
+        level_of.push_back(level);
+        if (level >= (int)this->levels.size()) {
+            this->levels.resize(level + 1);
+        }
+        this->levels[level].push_back(task_of[step]);
+    }
+}
+
+void NetworkSchedule::begin_timestep()
+{
+    this->timestep++;
+}
+
+void NetworkSchedule::run(int output, ThreadPool *pool)
+{
+    std::vector<bool> &needed = this->output_steps[output];
+    if (pool == nullptr || pool->thread_count == 1) {
+        for (int step : this->order) {
+            if (needed[step] && this->steps[step].last_timestep != this->timestep) {
+                this->run_step(step, pool);
+            }
+        }
+        return;
+    }
+    std::vector<int> level_tasks;
+    for (std::vector<int> &level : this->levels) {
+        level_tasks.clear();
+        for (int task : level) {
+            for (int step : this->tasks[task]) {
+                if (needed[step] && this->steps[step].last_timestep != this->timestep) {
+                    level_tasks.push_back(task);
+                    break;
+                }
+            }
+        }
+        // A task that runs on its own has the pool to itself
+        if (level_tasks.size() == 1) {
+            this->run_task(level_tasks[0], output, pool);
+        } else if (level_tasks.size() > 1) {
+            pool->run(level_tasks.size(), [this, &level_tasks, output](int i) {
+                this->run_task(level_tasks[i], output, nullptr);
+            });
+        }
+    }
+}
+
+void NetworkSchedule::run_task(int task, int output, ThreadPool *pool)
+{
+    std::vector<bool> &needed = this->output_steps[output];
+    for (int step : this->tasks[task]) {
+        if (needed[step] && this->steps[step].last_timestep != this->timestep) {
+            this->run_step(step, pool);
+        }
+    }
+}
+
+void NetworkSchedule::run_step(int step, ThreadPool *pool)
+{
+    Step &current_step = this->steps[step];
+    current_step.last_timestep = this->timestep;
+    if (current_step.stage) {
+        current_step.stage(pool);
+    } else {
+        current_step.kernel.function(current_step.kernel.data);
+    }
+}
@@ -0,0 +1,97 @@
+// Navigating with grid and place cells in cluttered environments
+// Edvardsen et al. (2020). Hippocampus, 30(3), 220-232.
+//
+// Licensed under the EUPL-1.2-or-later.
+// Copyright (c) 2019 NTNU - Norwegian University of Science and Technology.
+// Author: Vegard Edvardsen (https://github.com/evegard).
+
+#ifndef SCHEDULE_H_INCLUDED
+#define SCHEDULE_H_INCLUDED
+
+#include <functional>
+#include <map>
+#include <vector>
+
+#include "network.h"
+#include "parallel.h"
+
+// The updates of the networks within a timestep, worked out once from the
+// afferents of their inputs and compiled into a flat list of steps. Starting
+// from the outputs, the schedule takes in every network that an included
+// network reads from, up to the sources, which are updated elsewhere. Each
+// step comes after all of the steps that it reads from, so that it sees
+// their activity of the same timestep, while an input that reads its own
+// network sees the activity of the previous timestep and does not constrain
+// the order.
+//
+// Most steps update and commit a single network through the kernel that the
+// network compiles for itself. Networks that are updated together, such as
+// the grid sheets, which are batched across the modules, are instead added
+// as a stage, which is a step of its own that the schedule orders like any
+// other.
+//
+// Each timestep runs the steps that one or more of the outputs depend on,
+// each step at most once. For running on a thread pool, the steps are also
+// grouped into tasks, where a step that reads from only one step of the
+// schedule, which no other step reads from, joins the task of that step. The
+// tasks are then split into levels, each of which only depends on earlier
+// levels
+class NetworkSchedule
+{
+    public:
+        // Networks that are updated elsewhere, and only read by the schedule
+        void add_source(Network *network);
+        // Networks that are updated together by the given function rather
+        // than each by itself. The function gets the pool when it runs on
+        // its own, and null when it runs alongside other tasks
+        void add_stage(const std::vector<Network *> &networks,
+            std::function<void(ThreadPool *)> stage);
+        // Networks whose activity is needed at some point of the timestep,
+        // returning the output to pass to run()
+        int add_output(const std::vector<Network *> &networks);
+        // Orders the steps and compiles the kernels of the networks, once
+        // all sources, stages, outputs and inputs have been added
+        void compile();
+
+        // Starts a new timestep, in which each step runs at most once
+        void begin_timestep();
+        // Runs the steps that the output depends on and that have not yet
+        // run in this timestep, with the tasks of each level in parallel if
+        // a pool is given
+        void run(int output, ThreadPool *pool = nullptr);
+
+    protected:
+        struct Step {
+            std::vector<Network *> networks;
+            // The compiled kernel of a single network, or the stage
+            NetworkKernel kernel;
+            std::function<void(ThreadPool *)> stage;
+            // The steps that the step reads from
+            std::vector<int> afferents;
+            unsigned long last_timestep = 0;
+        };
+        std::vector<Step> steps;
+        std::map<Network *, int> step_of;
+        std::vector<Network *> sources;
+        std::vector<std::vector<Network *>> outputs;
+        unsigned long timestep = 1;
+
+        // The steps in order, whether each output needs each step, the
+        // steps of each task, in order, and the tasks of each level
+        std::vector<int> order;
+        std::vector<std::vector<bool>> output_steps;
+        std::vector<std::vector<int>> tasks;
+        std::vector<std::vector<int>> levels;
+
+        // Steps are visited depth first, and appended to the order once all
+        // of the steps that they read from have been appended
+        enum VisitState { unvisited, visiting, visited };
+        std::map<int, VisitState> visit_states;
+        int get_step(Network *network);
+        void visit(int step);
+        void group_tasks();
+        void run_task(int task, int output, ThreadPool *pool);
+        void run_step(int step, ThreadPool *pool);
+};
+
+#endif
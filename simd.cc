@@ -0,0 +1,716 @@
+// Navigating with grid and place cells in cluttered environments
+// Edvardsen et al. (2020). Hippocampus, 30(3), 220-232.
+//
+// Licensed under the EUPL-1.2-or-later.
+// Copyright (c) 2019 NTNU - Norwegian University of Science and Technology.
+// Author: Vegard Edvardsen (https://github.com/evegard).
+
+#include "simd.h"
+
+#include <immintrin.h>
+
+// The kernels that loop over the rows of a sheet are templates on the row
+// width, and are instantiated for the common sheet sizes so that the loop
+// bounds are known at compile time and the loops can be fully unrolled. A
+// width of 0 gives the generic instantiation, used for any other size
+#define SHEET_SIZE_DISPATCH(size, kernel, ...) \
+    switch (size) { \
+    case 32: return kernel<32>(__VA_ARGS__); \
+    case 40: return kernel<40>(__VA_ARGS__); \
+    case 48: return kernel<48>(__VA_ARGS__); \
+    case 64: return kernel<64>(__VA_ARGS__); \
+    default: return kernel<0>(__VA_ARGS__); \
+    }
+
+// Scalar versions, compiled for the baseline instruction set
+
+template<int WIDTH>
+static real scalar_shifted_dot_sized(const real *neurons, const real *weights,
+    int width, int height, int weights_stride)
+{
+    if (WIDTH) {
+        width = WIDTH;
+    }
+    real sum = 0.0;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            sum += neurons[x] * weights[x];
+        }
+        neurons += width;
+        weights += weights_stride;
+    }
+    return sum;
+}
+
+static real scalar_shifted_dot(const real *neurons, const real *weights,
+    int width, int height, int weights_stride)
+{
+    SHEET_SIZE_DISPATCH(width, scalar_shifted_dot_sized,
+        neurons, weights, width, height, weights_stride);
+}
+
+static void scalar_shifted_dot_batch(const real *const *neurons, int count,
+    const real *weights, int width, int height, int weights_stride, real *sums)
+{
+    for (int sheet = 0; sheet < count; sheet++) {
+        sums[sheet] = scalar_shifted_dot(neurons[sheet], weights, width, height, weights_stride);
+    }
+}
+
+static void scalar_axpy(real *values, const real *other, real factor, int size)
+{
+    for (int i = 0; i < size; i++) {
+        values[i] += factor * other[i];
+    }
+}
+
+template<int WIDTH>
+static void scalar_box_filter_sized(const real *input, int input_stride,
+    real *output, int width, int height)
+{
+    if (WIDTH) {
+        width = WIDTH;
+    }
+    for (int y = 0; y < height; y++) {
+        const real *row = &input[y * input_stride];
+        const real *previous_row = row - input_stride;
+        for (int x = 0; x < width; x++) {
+            output[y * width + x] += 0.25 * (
+                row[x] + row[x - 1] + previous_row[x] + previous_row[x - 1]);
+        }
+    }
+}
+
+static void scalar_box_filter(const real *input, int input_stride,
+    real *output, int width, int height)
+{
+    SHEET_SIZE_DISPATCH(width, scalar_box_filter_sized,
+        input, input_stride, output, width, height);
+}
+
+static void scalar_leaky_rectify(const real *inputs, const real *current,
+    real *next, const bool *enabled, int size, real bias, real rate)
+{
+    for (int i = 0; i < size; i++) {
+        if (enabled[i]) {
+            real input = bias + inputs[i];
+            if (input < 0.0) {
+                input = 0.0;
+            }
+            next[i] = current[i] + rate * (input - current[i]);
+        } else {
+            next[i] = current[i];
+        }
+    }
+}
+
+static real scalar_rectify_sum(const real *inputs, real *outputs, int size, real bias)
+{
+    real sum = 0.0;
+    for (int i = 0; i < size; i++) {
+        real output = inputs[i] + bias;
+        if (output < 0.0) {
+            output = 0.0;
+        }
+        outputs[i] = output;
+        sum += output;
+    }
+    return sum;
+}
+
+static real scalar_rectify_sum_pair(const real *inputs, const real *other_inputs,
+    real *outputs, int size, real bias)
+{
+    real sum = 0.0;
+    for (int i = 0; i < size; i++) {
+        real output = inputs[i] + other_inputs[i] + bias;
+        if (output < 0.0) {
+            output = 0.0;
+        }
+        outputs[i] = output;
+        sum += output;
+    }
+    return sum;
+}
+
+static void scalar_clear(real *values, int size)
+{
+    for (int i = 0; i < size; i++) {
+        values[i] = 0.0;
+    }
+}
+
+static void scalar_copy(real *destination, const real *source, int size)
+{
+    for (int i = 0; i < size; i++) {
+        destination[i] = source[i];
+    }
+}
+
+static real scalar_sum(const real *values, int size)
+{
+    real sum = 0.0;
+    for (int i = 0; i < size; i++) {
+        sum += values[i];
+    }
+    return sum;
+}
+
+// AVX2 + FMA versions, 8 floats per vector. Remainders are handled by the
+// scalar code above
+
+#define AVX2 __attribute__((target("avx2,fma")))
+
+AVX2 static inline real avx2_horizontal_sum(__m256 vector)
+{
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(vector), _mm256_extractf128_ps(vector, 1));
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_movehdup_ps(sum));
+    return _mm_cvtss_f32(sum);
+}
+
+template<int WIDTH>
+AVX2 static real avx2_shifted_dot_sized(const real *neurons, const real *weights,
+    int width, int height, int weights_stride)
+{
+    if (WIDTH) {
+        width = WIDTH;
+    }
+    // The loop is bound by the latency of the fused multiply-adds rather than
+    // by their throughput, so spread the work over four independent sums
+    __m256 sums[4] = { _mm256_setzero_ps(), _mm256_setzero_ps(),
+        _mm256_setzero_ps(), _mm256_setzero_ps() };
+    real tail = 0.0;
+    for (int y = 0; y < height; y++) {
+        int x = 0;
+        for (; x + 32 <= width; x += 32) {
+            for (int i = 0; i < 4; i++) {
+                sums[i] = _mm256_fmadd_ps(_mm256_loadu_ps(&neurons[x + 8 * i]),
+                    _mm256_loadu_ps(&weights[x + 8 * i]), sums[i]);
+            }
+        }
+        for (int i = 0; x + 8 <= width; x += 8, i++) {
+            sums[i] = _mm256_fmadd_ps(
+                _mm256_loadu_ps(&neurons[x]), _mm256_loadu_ps(&weights[x]), sums[i]);
+        }
+        for (; x < width; x++) {
+            tail += neurons[x] * weights[x];
+        }
+        neurons += width;
+        weights += weights_stride;
+    }
+    return avx2_horizontal_sum(_mm256_add_ps(
+        _mm256_add_ps(sums[0], sums[1]), _mm256_add_ps(sums[2], sums[3]))) + tail;
+}
+
+template<int SHEETS, int WIDTH>
+AVX2 static void avx2_shifted_dot_group(const real *const *neurons,
+    const real *weights, int width, int height, int weights_stride, real *sums)
+{
+    if (WIDTH) {
+        width = WIDTH;
+    }
+    // Each vector of weights is loaded once and multiplied with the
+    // corresponding vector of all the sheets in the group. Two sums per
+    // sheet keep enough independent multiply-adds in flight
+    __m256 vector_sums[SHEETS][2];
+    real tail[SHEETS];
+    for (int sheet = 0; sheet < SHEETS; sheet++) {
+        vector_sums[sheet][0] = _mm256_setzero_ps();
+        vector_sums[sheet][1] = _mm256_setzero_ps();
+        tail[sheet] = 0.0;
+    }
+    for (int y = 0; y < height; y++) {
+        int offset = y * width;
+        int x = 0;
+        for (int i = 0; x + 8 <= width; x += 8, i ^= 1) {
+            __m256 weight = _mm256_loadu_ps(&weights[x]);
+            for (int sheet = 0; sheet < SHEETS; sheet++) {
+                vector_sums[sheet][i] = _mm256_fmadd_ps(
+                    _mm256_loadu_ps(&neurons[sheet][offset + x]), weight, vector_sums[sheet][i]);
+            }
+        }
+        for (; x < width; x++) {
+            for (int sheet = 0; sheet < SHEETS; sheet++) {
+                tail[sheet] += neurons[sheet][offset + x] * weights[x];
+            }
+        }
+        weights += weights_stride;
+    }
+    for (int sheet = 0; sheet < SHEETS; sheet++) {
+        sums[sheet] = tail[sheet] + avx2_horizontal_sum(
+            _mm256_add_ps(vector_sums[sheet][0], vector_sums[sheet][1]));
+    }
+}
+
+AVX2 static real avx2_shifted_dot(const real *neurons, const real *weights,
+    int width, int height, int weights_stride)
+{
+    SHEET_SIZE_DISPATCH(width, avx2_shifted_dot_sized,
+        neurons, weights, width, height, weights_stride);
+}
+
+template<int WIDTH>
+AVX2 static void avx2_shifted_dot_batch_sized(const real *const *neurons, int count,
+    const real *weights, int width, int height, int weights_stride, real *sums)
+{
+    for (int sheet = 0; sheet < count; sheet += 4) {
+        const real *const *group = &neurons[sheet];
+        switch (MIN(count - sheet, 4)) {
+        case 4: avx2_shifted_dot_group<4, WIDTH>(group, weights, width, height, weights_stride, &sums[sheet]); break;
+        case 3: avx2_shifted_dot_group<3, WIDTH>(group, weights, width, height, weights_stride, &sums[sheet]); break;
+        case 2: avx2_shifted_dot_group<2, WIDTH>(group, weights, width, height, weights_stride, &sums[sheet]); break;
+        default: sums[sheet] = avx2_shifted_dot_sized<WIDTH>(*group, weights, width, height, weights_stride); break;
+        }
+    }
+}
+
+AVX2 static void avx2_shifted_dot_batch(const real *const *neurons, int count,
+    const real *weights, int width, int height, int weights_stride, real *sums)
+{
+    SHEET_SIZE_DISPATCH(width, avx2_shifted_dot_batch_sized,
+        neurons, count, weights, width, height, weights_stride, sums);
+}
+
+AVX2 static void avx2_axpy(real *values, const real *other, real factor, int size)
+{
+    __m256 factors = _mm256_set1_ps(factor);
+    int i = 0;
+    for (; i + 8 <= size; i += 8) {
+        _mm256_storeu_ps(&values[i], _mm256_fmadd_ps(
+            factors, _mm256_loadu_ps(&other[i]), _mm256_loadu_ps(&values[i])));
+    }
+    scalar_axpy(&values[i], &other[i], factor, size - i);
+}
+
+template<int WIDTH>
+AVX2 static void avx2_box_filter_sized(const real *input, int input_stride,
+    real *output, int width, int height)
+{
+    if (WIDTH) {
+        width = WIDTH;
+    }
+    __m256 quarter = _mm256_set1_ps(0.25);
+    for (int y = 0; y < height; y++) {
+        const real *row = &input[y * input_stride];
+        const real *previous_row = row - input_stride;
+        real *output_row = &output[y * width];
+        int x = 0;
+        for (; x + 8 <= width; x += 8) {
+            __m256 column_sums = _mm256_add_ps(
+                _mm256_loadu_ps(&row[x]), _mm256_loadu_ps(&previous_row[x]));
+            __m256 previous_column_sums = _mm256_add_ps(
+                _mm256_loadu_ps(&row[x - 1]), _mm256_loadu_ps(&previous_row[x - 1]));
+            _mm256_storeu_ps(&output_row[x], _mm256_fmadd_ps(quarter,
+                _mm256_add_ps(column_sums, previous_column_sums),
+                _mm256_loadu_ps(&output_row[x])));
+        }
+        for (; x < width; x++) {
+            output_row[x] += 0.25 * (row[x] + row[x - 1] + previous_row[x] + previous_row[x - 1]);
+        }
+    }
+}
+
+AVX2 static void avx2_box_filter(const real *input, int input_stride,
+    real *output, int width, int height)
+{
+    SHEET_SIZE_DISPATCH(width, avx2_box_filter_sized,
+        input, input_stride, output, width, height);
+}
+
+AVX2 static void avx2_leaky_rectify(const real *inputs, const real *current,
+    real *next, const bool *enabled, int size, real bias, real rate)
+{
+    __m256 biases = _mm256_set1_ps(bias);
+    __m256 rates = _mm256_set1_ps(rate);
+    __m256 zeros = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= size; i += 8) {
+        __m256 input = _mm256_max_ps(_mm256_add_ps(biases, _mm256_loadu_ps(&inputs[i])), zeros);
+        __m256 previous = _mm256_loadu_ps(&current[i]);
+        __m256 updated = _mm256_fmadd_ps(rates, _mm256_sub_ps(input, previous), previous);
+        __m256i flags = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)&enabled[i]));
+        __m256 mask = _mm256_castsi256_ps(_mm256_cmpgt_epi32(flags, _mm256_setzero_si256()));
+        _mm256_storeu_ps(&next[i], _mm256_blendv_ps(previous, updated, mask));
+    }
+    scalar_leaky_rectify(&inputs[i], &current[i], &next[i], &enabled[i], size - i, bias, rate);
+}
+
+AVX2 static real avx2_rectify_sum(const real *inputs, real *outputs, int size, real bias)
+{
+    __m256 biases = _mm256_set1_ps(bias);
+    __m256 zeros = _mm256_setzero_ps();
+    __m256 sums = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= size; i += 8) {
+        __m256 output = _mm256_max_ps(_mm256_add_ps(_mm256_loadu_ps(&inputs[i]), biases), zeros);
+        _mm256_storeu_ps(&outputs[i], output);
+        sums = _mm256_add_ps(sums, output);
+    }
+    return avx2_horizontal_sum(sums) + scalar_rectify_sum(&inputs[i], &outputs[i], size - i, bias);
+}
+
+AVX2 static real avx2_rectify_sum_pair(const real *inputs, const real *other_inputs,
+    real *outputs, int size, real bias)
+{
+    __m256 biases = _mm256_set1_ps(bias);
+    __m256 zeros = _mm256_setzero_ps();
+    __m256 sums = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= size; i += 8) {
+        __m256 input = _mm256_add_ps(_mm256_loadu_ps(&inputs[i]), _mm256_loadu_ps(&other_inputs[i]));
+        __m256 output = _mm256_max_ps(_mm256_add_ps(input, biases), zeros);
+        _mm256_storeu_ps(&outputs[i], output);
+        sums = _mm256_add_ps(sums, output);
+    }
+    return avx2_horizontal_sum(sums) +
+        scalar_rectify_sum_pair(&inputs[i], &other_inputs[i], &outputs[i], size - i, bias);
+}
+
+AVX2 static void avx2_clear(real *values, int size)
+{
+    int i = 0;
+    for (; i + 8 <= size; i += 8) {
+        _mm256_storeu_ps(&values[i], _mm256_setzero_ps());
+    }
+    scalar_clear(&values[i], size - i);
+}
+
+AVX2 static void avx2_copy(real *destination, const real *source, int size)
+{
+    int i = 0;
+    for (; i + 8 <= size; i += 8) {
+        _mm256_storeu_ps(&destination[i], _mm256_loadu_ps(&source[i]));
+    }
+    scalar_copy(&destination[i], &source[i], size - i);
+}
+
+AVX2 static real avx2_sum(const real *values, int size)
+{
+    __m256 sums = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= size; i += 8) {
+        sums = _mm256_add_ps(sums, _mm256_loadu_ps(&values[i]));
+    }
+    return avx2_horizontal_sum(sums) + scalar_sum(&values[i], size - i);
+}
+
+// AVX-512 versions, 16 floats per vector. Remainders are handled with
+// masked loads and stores
+
+#define AVX512 __attribute__((target("avx512f")))
+
+AVX512 static inline __mmask16 avx512_mask(int remaining)
+{
+    // All lanes for full vectors, and the first (remaining) lanes otherwise
+    return remaining >= 16 ? (__mmask16)0xffff : (__mmask16)((1u << remaining) - 1);
+}
+
+template<int WIDTH>
+AVX512 static real avx512_shifted_dot_sized(const real *neurons, const real *weights,
+    int width, int height, int weights_stride)
+{
+    if (WIDTH) {
+        width = WIDTH;
+    }
+    // Independent sums for the vectors within a row and for every other row,
+    // as for the AVX2 version
+    __m512 sums[4] = { _mm512_setzero_ps(), _mm512_setzero_ps(),
+        _mm512_setzero_ps(), _mm512_setzero_ps() };
+    int vector_width = width & ~15;
+    __mmask16 tail = avx512_mask(width - vector_width);
+    for (int y = 0; y < height; y++) {
+        __m512 *row_sums = &sums[2 * (y & 1)];
+        int x = 0;
+        for (; x + 32 <= vector_width; x += 32) {
+            row_sums[0] = _mm512_fmadd_ps(_mm512_loadu_ps(&neurons[x]),
+                _mm512_loadu_ps(&weights[x]), row_sums[0]);
+            row_sums[1] = _mm512_fmadd_ps(_mm512_loadu_ps(&neurons[x + 16]),
+                _mm512_loadu_ps(&weights[x + 16]), row_sums[1]);
+        }
+        if (x < vector_width) {
+            row_sums[0] = _mm512_fmadd_ps(_mm512_loadu_ps(&neurons[x]),
+                _mm512_loadu_ps(&weights[x]), row_sums[0]);
+        }
+        if (tail) {
+            row_sums[1] = _mm512_fmadd_ps(
+                _mm512_maskz_loadu_ps(tail, &neurons[vector_width]),
+                _mm512_maskz_loadu_ps(tail, &weights[vector_width]), row_sums[1]);
+        }
+        neurons += width;
+        weights += weights_stride;
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(
+        _mm512_add_ps(sums[0], sums[1]), _mm512_add_ps(sums[2], sums[3])));
+}
+
+template<int SHEETS, int WIDTH>
+AVX512 static void avx512_shifted_dot_group(const real *const *neurons,
+    const real *weights, int width, int height, int weights_stride, real *sums)
+{
+    if (WIDTH) {
+        width = WIDTH;
+    }
+    // As for the AVX2 version, with masked loads for the end of each row
+    __m512 vector_sums[SHEETS][2];
+    for (int sheet = 0; sheet < SHEETS; sheet++) {
+        vector_sums[sheet][0] = _mm512_setzero_ps();
+        vector_sums[sheet][1] = _mm512_setzero_ps();
+    }
+    for (int y = 0; y < height; y++) {
+        int offset = y * width;
+        for (int x = 0, i = 0; x < width; x += 16, i ^= 1) {
+            __mmask16 mask = avx512_mask(width - x);
+            __m512 weight = _mm512_maskz_loadu_ps(mask, &weights[x]);
+            for (int sheet = 0; sheet < SHEETS; sheet++) {
+                vector_sums[sheet][i] = _mm512_fmadd_ps(
+                    _mm512_maskz_loadu_ps(mask, &neurons[sheet][offset + x]), weight,
+                    vector_sums[sheet][i]);
+            }
+        }
+        weights += weights_stride;
+    }
+    for (int sheet = 0; sheet < SHEETS; sheet++) {
+        sums[sheet] = _mm512_reduce_add_ps(
+            _mm512_add_ps(vector_sums[sheet][0], vector_sums[sheet][1]));
+    }
+}
+
+AVX512 static real avx512_shifted_dot(const real *neurons, const real *weights,
+    int width, int height, int weights_stride)
+{
+    SHEET_SIZE_DISPATCH(width, avx512_shifted_dot_sized,
+        neurons, weights, width, height, weights_stride);
+}
+
+template<int WIDTH>
+AVX512 static void avx512_shifted_dot_batch_sized(const real *const *neurons, int count,
+    const real *weights, int width, int height, int weights_stride, real *sums)
+{
+    for (int sheet = 0; sheet < count; sheet += 4) {
+        const real *const *group = &neurons[sheet];
+        switch (MIN(count - sheet, 4)) {
+        case 4: avx512_shifted_dot_group<4, WIDTH>(group, weights, width, height, weights_stride, &sums[sheet]); break;
+        case 3: avx512_shifted_dot_group<3, WIDTH>(group, weights, width, height, weights_stride, &sums[sheet]); break;
+        case 2: avx512_shifted_dot_group<2, WIDTH>(group, weights, width, height, weights_stride, &sums[sheet]); break;
+        default: sums[sheet] = avx512_shifted_dot_sized<WIDTH>(*group, weights, width, height, weights_stride); break;
+        }
+    }
+}
+
+AVX512 static void avx512_shifted_dot_batch(const real *const *neurons, int count,
+    const real *weights, int width, int height, int weights_stride, real *sums)
+{
+    SHEET_SIZE_DISPATCH(width, avx512_shifted_dot_batch_sized,
+        neurons, count, weights, width, height, weights_stride, sums);
+}
+
+AVX512 static void avx512_axpy(real *values, const real *other, real factor, int size)
+{
+    __m512 factors = _mm512_set1_ps(factor);
+    for (int i = 0; i < size; i += 16) {
+        __mmask16 mask = avx512_mask(size - i);
+        _mm512_mask_storeu_ps(&values[i], mask, _mm512_fmadd_ps(factors,
+            _mm512_maskz_loadu_ps(mask, &other[i]), _mm512_maskz_loadu_ps(mask, &values[i])));
+    }
+}
+
+template<int WIDTH>
+AVX512 static void avx512_box_filter_sized(const real *input, int input_stride,
+    real *output, int width, int height)
+{
+    if (WIDTH) {
+        width = WIDTH;
+    }
+    __m512 quarter = _mm512_set1_ps(0.25);
+    for (int y = 0; y < height; y++) {
+        const real *row = &input[y * input_stride];
+        const real *previous_row = row - input_stride;
+        real *output_row = &output[y * width];
+        for (int x = 0; x < width; x += 16) {
+            __mmask16 mask = avx512_mask(width - x);
+            __m512 column_sums = _mm512_add_ps(
+                _mm512_maskz_loadu_ps(mask, &row[x]), _mm512_maskz_loadu_ps(mask, &previous_row[x]));
+            __m512 previous_column_sums = _mm512_add_ps(
+                _mm512_maskz_loadu_ps(mask, &row[x - 1]), _mm512_maskz_loadu_ps(mask, &previous_row[x - 1]));
+            _mm512_mask_storeu_ps(&output_row[x], mask, _mm512_fmadd_ps(quarter,
+                _mm512_add_ps(column_sums, previous_column_sums),
+                _mm512_maskz_loadu_ps(mask, &output_row[x])));
+        }
+    }
+}
+
+AVX512 static void avx512_box_filter(const real *input, int input_stride,
+    real *output, int width, int height)
+{
+    SHEET_SIZE_DISPATCH(width, avx512_box_filter_sized,
+        input, input_stride, output, width, height);
+}
+
+AVX512 static void avx512_leaky_rectify(const real *inputs, const real *current,
+    real *next, const bool *enabled, int size, real bias, real rate)
+{
+    __m512 biases = _mm512_set1_ps(bias);
+    __m512 rates = _mm512_set1_ps(rate);
+    __m512 zeros = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m512 input = _mm512_max_ps(_mm512_add_ps(biases, _mm512_loadu_ps(&inputs[i])), zeros);
+        __m512 previous = _mm512_loadu_ps(&current[i]);
+        __m512 updated = _mm512_fmadd_ps(rates, _mm512_sub_ps(input, previous), previous);
+        __m512i flags = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)&enabled[i]));
+        __mmask16 mask = _mm512_test_epi32_mask(flags, flags);
+        _mm512_storeu_ps(&next[i], _mm512_mask_blend_ps(mask, previous, updated));
+    }
+    scalar_leaky_rectify(&inputs[i], &current[i], &next[i], &enabled[i], size - i, bias, rate);
+}
+
+AVX512 static real avx512_rectify_sum(const real *inputs, real *outputs, int size, real bias)
+{
+    __m512 biases = _mm512_set1_ps(bias);
+    __m512 zeros = _mm512_setzero_ps();
+    __m512 sums = _mm512_setzero_ps();
+    for (int i = 0; i < size; i += 16) {
+        __mmask16 mask = avx512_mask(size - i);
+        __m512 output = _mm512_max_ps(
+            _mm512_add_ps(_mm512_maskz_loadu_ps(mask, &inputs[i]), biases), zeros);
+        _mm512_mask_storeu_ps(&outputs[i], mask, output);
+        sums = _mm512_add_ps(sums, _mm512_maskz_mov_ps(mask, output));
+    }
+    return _mm512_reduce_add_ps(sums);
+}
+
+AVX512 static real avx512_rectify_sum_pair(const real *inputs, const real *other_inputs,
+    real *outputs, int size, real bias)
+{
+    __m512 biases = _mm512_set1_ps(bias);
+    __m512 zeros = _mm512_setzero_ps();
+    __m512 sums = _mm512_setzero_ps();
+    for (int i = 0; i < size; i += 16) {
+        __mmask16 mask = avx512_mask(size - i);
+        __m512 input = _mm512_add_ps(_mm512_maskz_loadu_ps(mask, &inputs[i]),
+            _mm512_maskz_loadu_ps(mask, &other_inputs[i]));
+        __m512 output = _mm512_max_ps(_mm512_add_ps(input, biases), zeros);
+        _mm512_mask_storeu_ps(&outputs[i], mask, output);
+        sums = _mm512_add_ps(sums, _mm512_maskz_mov_ps(mask, output));
+    }
+    return _mm512_reduce_add_ps(sums);
+}
+
+AVX512 static void avx512_clear(real *values, int size)
+{
+    for (int i = 0; i < size; i += 16) {
+        __mmask16 mask = avx512_mask(size - i);
+        _mm512_mask_storeu_ps(&values[i], mask, _mm512_setzero_ps());
+    }
+}
+
+AVX512 static void avx512_copy(real *destination, const real *source, int size)
+{
+    for (int i = 0; i < size; i += 16) {
+        __mmask16 mask = avx512_mask(size - i);
+        _mm512_mask_storeu_ps(&destination[i], mask, _mm512_maskz_loadu_ps(mask, &source[i]));
+    }
+}
+
+AVX512 static real avx512_sum(const real *values, int size)
+{
+    __m512 sums = _mm512_setzero_ps();
+    for (int i = 0; i < size; i += 16) {
+        __mmask16 mask = avx512_mask(size - i);
+        sums = _mm512_add_ps(sums, _mm512_maskz_loadu_ps(mask, &values[i]));
+    }
+    return _mm512_reduce_add_ps(sums);
+}
+
+// Dispatch
+
+SimdInstructionSet Simd::instruction_set = simd_scalar;
+real (*Simd::shifted_dot)(const real *, const real *, int, int, int) = scalar_shifted_dot;
+void (*Simd::shifted_dot_batch)(const real *const *, int, const real *, int, int, int, real *) =
+    scalar_shifted_dot_batch;
+void (*Simd::axpy)(real *, const real *, real, int) = scalar_axpy;
+void (*Simd::box_filter)(const real *, int, real *, int, int) = scalar_box_filter;
+void (*Simd::leaky_rectify)(const real *, const real *, real *, const bool *, int, real, real) =
+    scalar_leaky_rectify;
+real (*Simd::rectify_sum)(const real *, real *, int, real) = scalar_rectify_sum;
+real (*Simd::rectify_sum_pair)(const real *, const real *, real *, int, real) =
+    scalar_rectify_sum_pair;
+void (*Simd::clear)(real *, int) = scalar_clear;
+void (*Simd::copy)(real *, const real *, int) = scalar_copy;
+real (*Simd::sum)(const real *, int) = scalar_sum;
+
+SimdInstructionSet Simd::detect()
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return simd_avx512;
+    } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return simd_avx2;
+    } else {
+        return simd_scalar;
+    }
+}
+
+bool Simd::select(SimdInstructionSet instruction_set)
+{
+    // Refuse to select an instruction set that is more capable than what
+    // the CPU supports
+    if (instruction_set > Simd::detect()) {
+        return false;
+    }
+    Simd::instruction_set = instruction_set;
+    switch (instruction_set) {
+    case simd_avx512:
+        Simd::shifted_dot = avx512_shifted_dot;
+        Simd::shifted_dot_batch = avx512_shifted_dot_batch;
+        Simd::axpy = avx512_axpy;
+        Simd::box_filter = avx512_box_filter;
+        Simd::leaky_rectify = avx512_leaky_rectify;
+        Simd::rectify_sum = avx512_rectify_sum;
+        Simd::rectify_sum_pair = avx512_rectify_sum_pair;
+        Simd::clear = avx512_clear;
+        Simd::copy = avx512_copy;
+        Simd::sum = avx512_sum;
+        break;
+    case simd_avx2:
+        Simd::shifted_dot = avx2_shifted_dot;
+        Simd::shifted_dot_batch = avx2_shifted_dot_batch;
+        Simd::axpy = avx2_axpy;
+        Simd::box_filter = avx2_box_filter;
+        Simd::leaky_rectify = avx2_leaky_rectify;
+        Simd::rectify_sum = avx2_rectify_sum;
+        Simd::rectify_sum_pair = avx2_rectify_sum_pair;
+        Simd::clear = avx2_clear;
+        Simd::copy = avx2_copy;
+        Simd::sum = avx2_sum;
+        break;
+    default:
+        Simd::shifted_dot = scalar_shifted_dot;
+        Simd::shifted_dot_batch = scalar_shifted_dot_batch;
+        Simd::axpy = scalar_axpy;
+        Simd::box_filter = scalar_box_filter;
+        Simd::leaky_rectify = scalar_leaky_rectify;
+        Simd::rectify_sum = scalar_rectify_sum;
+        Simd::rectify_sum_pair = scalar_rectify_sum_pair;
+        Simd::clear = scalar_clear;
+        Simd::copy = scalar_copy;
+        Simd::sum = scalar_sum;
+        break;
+    }
+    return true;
+}
+
+const char *Simd::name(SimdInstructionSet instruction_set)
+{
+    switch (instruction_set) {
+    case simd_avx512: return "avx512";
+    case simd_avx2: return "avx2";
+    default: return "scalar";
+    }
+}
+
+// Select the best supported instruction set at startup. The function
+// pointers above are constant-initialized to the scalar versions, so they
+// are valid even before this runs
+static bool simd_selected_at_startup = Simd::select(Simd::detect());
@@ -0,0 +1,63 @@
+// Navigating with grid and place cells in cluttered environments
+// Edvardsen et al. (2020). Hippocampus, 30(3), 220-232.
+//
+// Licensed under the EUPL-1.2-or-later.
+// Copyright (c) 2019 NTNU - Norwegian University of Science and Technology.
+// Author: Vegard Edvardsen (https://github.com/evegard).
+
+#ifndef SIMD_H_INCLUDED
+#define SIMD_H_INCLUDED
+
+#include "numerical.h"
+
+enum SimdInstructionSet {
+    simd_scalar,
+    simd_avx2,
+    simd_avx512,
+
+    SIMD_INSTRUCTION_SET_COUNT
+};
+
+// Hand-vectorized versions of the innermost loops over the neural sheets.
+// Each kernel is compiled for several instruction sets, and the function
+// pointers below are set at startup to the best variant that the CPU
+// supports, so that the same binary can run on any x86-64 machine.
+class Simd
+{
+    public:
+        static SimdInstructionSet detect();
+        static bool select(SimdInstructionSet instruction_set);
+        static const char *name(SimdInstructionSet instruction_set);
+
+        static SimdInstructionSet instruction_set;
+
+        // Sum of neurons[y * width + x] * weights[y * weights_stride + x]
+        static real (*shifted_dot)(const real *neurons, const real *weights,
+            int width, int height, int weights_stride);
+        // sums[i] = shifted_dot(neurons[i], weights, ...) for each of the count
+        // sheets, reading each window of weights only once for all of them
+        static void (*shifted_dot_batch)(const real *const *neurons, int count,
+            const real *weights, int width, int height, int weights_stride, real *sums);
+        // values[i] += factor * other[i]
+        static void (*axpy)(real *values, const real *other, real factor, int size);
+        // output[y][x] += average of input over the 2x2 block with (x, y) as
+        // its upper right corner. The input is a halo-padded sheet, i.e. it
+        // is read at row -1 and column -1 and rows are input_stride apart
+        static void (*box_filter)(const real *input, int input_stride,
+            real *output, int width, int height);
+        // next[i] = current[i] + rate * (max(bias + inputs[i], 0) - current[i])
+        // for enabled neurons, next[i] = current[i] for the others
+        static void (*leaky_rectify)(const real *inputs, const real *current,
+            real *next, const bool *enabled, int size, real bias, real rate);
+        // outputs[i] = max(inputs[i] + bias, 0), returning the sum of outputs
+        static real (*rectify_sum)(const real *inputs, real *outputs, int size, real bias);
+        // outputs[i] = max(inputs[i] + other_inputs[i] + bias, 0), returning
+        // the sum of outputs
+        static real (*rectify_sum_pair)(const real *inputs, const real *other_inputs,
+            real *outputs, int size, real bias);
+        static void (*clear)(real *values, int size);
+        static void (*copy)(real *destination, const real *source, int size);
+        static real (*sum)(const real *values, int size);
+};
+
+#endif
@@ -31,6 +31,44 @@ Simulation::Simulation(Agent *agent, struct SimulationConf conf)
     } else {
         this->script = new std::fstream(conf.script_source, std::ios::in);
     }
+    this->build_timestep_graph();
+}
+
+void Simulation::build_timestep_graph()
+{
+    Model *model = this->agent->model;
+    this->timestep_graph = new TaskGraph();
+
+    int sensors = this->timestep_graph->add_task("border sensors", [this, model]() {
+        this->arena->update_sensors(this->x, this->y, model->conf.sensor_range,
+            model->border_sensors->values, model->border_sensors->size);
+    });
+    int grid_modules = this->timestep_graph->add_task("grid modules", [this, model]() {
+        model->integrate_grid_modules(this->heading, this->speed, model->thread_pool);
+    });
+    int place_cells = this->timestep_graph->add_task("closest place cell", [this, model]() {
+        model->place_graph->locate(this->x, this->y);
+    });
+    this->timestep_graph->add_task("agent", [this]() {
+        this->agent->execute();
+    }, { sensors, grid_modules, place_cells });
+
+    // The grid modules task runs the pool of the model from within a thread
+    // of the timestep pool, so the other threads of the timestep pool are
+    // taken from the pool of the model, which keeps the two pools together
+    // at the given number of threads
+    int timestep_threads = MIN(this->timestep_graph->get_width(), model->conf.thread_count);
+    this->timestep_pool = new ThreadPool(timestep_threads);
+    if (timestep_threads > 1) {
+        delete model->thread_pool;
+        model->thread_pool = new ThreadPool(
+            model->conf.thread_count - timestep_threads + 1, model->conf.pin_threads);
+    }
+
+    if (this->conf.task_graph_dump != "") {
+        std::ofstream stream(this->conf.task_graph_dump);
+        this->timestep_graph->dump(stream);
+    }
 }
 
 bool Simulation::step()
@@ -42,14 +80,9 @@ bool Simulation::step()
             this->agent->previous_state, this->agent->active_state);
     }
 
-    // Update border sensor inputs to the model
-    this->arena->update_sensors(this->x, this->y,
-        this->agent->model->conf.sensor_range,
-        this->agent->model->border_sensors->values,
-        this->agent->model->border_sensors->size);
-
-    // Update inputs to the agent and execute the current agent state (which in
-    // turn invokes a timestep update of the model)
+    // Update inputs to the agent, and run the timestep graph, which updates
+    // the border sensor inputs to the model and then executes the current
+    // agent state (which in turn invokes a timestep update of the model)
     this->agent->input = {
         .x = this->x,
         .y = this->y,
@@ -59,7 +92,7 @@ bool Simulation::step()
         .goto_y = this->goto_y,
         .reward_id = this->reward_id,
     };
-    this->agent->execute();
+    this->timestep_graph->run(this->timestep_pool);
 
     this->heading = Periodic::double_modulo(this->agent->output.heading, 2 * M_PI);
     this->speed = this->agent->output.speed;
@@ -14,6 +14,7 @@
 #include "main.h"
 #include "mec.h"
 #include "numerical.h"
+#include "parallel.h"
 
 #include <vector>
 #include <map>
@@ -36,6 +37,16 @@ class Simulation
         // Function called on each timestep to update model and simulation
         bool step();
 
+        // The work of each timestep up to and including the agent. The border
+        // sensors, the grid modules and the search for the closest place cell
+        // only depend on the position and velocity of the agent, and run
+        // alongside each other before the agent runs the rest of the model.
+        // The pool is kept apart from the one of the model, which the grid
+        // modules use from within their task, and the two share the threads
+        TaskGraph *timestep_graph;
+        ThreadPool *timestep_pool;
+        void build_timestep_graph();
+
         // Main simulation values. All of these are initialized in run()
         int global_timestep;
         double x, y, heading, speed;